@@ -0,0 +1,340 @@
+/*
+** Runs a fixed set of workloads through fe_read() and fe_eval() (or
+** fe_compile() and fe_run()) and reports, per workload and mode, the best
+** and median wall time of the timed runs along with the objects allocated,
+** GC cycles started, allocations that stalled on a cycle and the most
+** objects any cycle found live in one run, as given by fe_stats().
+**
+** `-o file` also writes the results as tab-separated lines, one per workload
+** and mode, that can be diffed between commits.
+**
+** gcc bench/bench.c src/fe.c -Isrc -O3 -o fe_bench
+** ./fe_bench [-n runs] [-w warmups] [-o file] [name...]
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <setjmp.h>
+#include <string.h>
+#include <time.h>
+#include "fe.h"
+
+#define HEAPSIZE (512 * 1024)
+#define MAXRUNS  64
+
+typedef struct {
+  const char *name;
+  const char *src;
+  const char *expect;
+  char* (*gen)(void);
+} Workload;
+
+typedef struct { const char *p; } Reader;
+
+typedef struct {
+  double time;
+  fe_Stats stats;
+  char result[64];
+} Result;
+
+
+static char* gensymbols(void);
+static char* genstrings(void);
+static char* genarrays(void);
+
+static Workload workloads[] = {
+  { "recursion",
+    "(= fib (fn (n) (if (<= 2 n) (+ (fib (- n 1)) (fib (- n 2))) n)))"
+    "(fib 22)",
+    "17711", NULL },
+
+  { "float",
+    "(do (let sum 0) (let py 0)"
+    "  (while (< py 60)"
+    "    (let y (- (/ py 30) 1)) (let px 0)"
+    "    (while (< px 120)"
+    "      (let x (- (/ px 40) 2)) (let x0 x) (let y0 y) (let iter 0)"
+    "      (while (and (< iter 32) (<= (+ (* x0 x0) (* y0 y0)) 4))"
+    "        (let x1 (+ (- (* x0 x0) (* y0 y0)) x))"
+    "        (= y0 (+ (* 2 x0 y0) y)) (= x0 x1) (= iter (+ iter 1)))"
+    "      (= sum (+ sum iter)) (= px (+ px 1)))"
+    "    (= py (+ py 1)))"
+    "  sum)",
+    "84690", NULL },
+
+  { "lists",
+    "(= reverse (fn (lst) (let res nil)"
+    "  (while lst (= res (cons (car lst) res)) (= lst (cdr lst))) res))"
+    "(= range (fn (n) (let res nil)"
+    "  (while (< 0 n) (= n (- n 1)) (= res (cons n res))) res))"
+    "(= map (fn (f lst) (let res nil)"
+    "  (while lst (= res (cons (f (car lst)) res)) (= lst (cdr lst)))"
+    "  (reverse res)))"
+    "(do (let i 0) (let lst nil)"
+    "  (while (< i 100) (= lst (map (fn (x) (* x 2)) (range 500)))"
+    "    (= i (+ i 1)))"
+    "  (car (reverse lst)))",
+    "998", NULL },
+
+  { "strings", NULL, "t", genstrings },
+
+  { "symbols", NULL, "t", gensymbols },
+
+  { "closures",
+    "(= chain (fn (n) (if (is n 0) (fn (x) x)"
+    "  (do (let f (chain (- n 1))) (fn (x) (f (+ x 1)))))))"
+    "(do (let i 0) (let sum 0)"
+    "  (while (< i 500) (= sum (+ sum ((chain 40) i))) (= i (+ i 1)))"
+    "  sum)",
+    "144750", NULL },
+
+  { "captures",
+    /* small closures made by a fn whose other locals are large */
+    "(= make (fn (i) (let big nil) (let j 0)"
+    "  (while (< j 50) (= big (cons j big)) (= j (+ j 1)))"
+    "  (let n (car big)) (fn () (+ i n))))"
+    "(do (let round 0) (let sum 0)"
+    "  (while (< round 10) (let fs nil) (let i 0)"
+    "    (while (< i 200) (= fs (cons (make i) fs)) (= i (+ i 1)))"
+    "    (while fs (= sum (+ sum ((car fs)))) (= fs (cdr fs)))"
+    "    (= round (+ round 1)))"
+    "  sum)",
+    "297000", NULL },
+
+  { "vectors",
+    "(do (let n 5000) (let sieve (makevec n t)) (let i 2) (let count 0)"
+    "  (while (< i n)"
+    "    (if (vecget sieve i)"
+    "      (do (= count (+ count 1)) (let j (* i i))"
+    "        (while (< j n) (vecset sieve j nil) (= j (+ j i)))))"
+    "    (= i (+ i 1)))"
+    "  count)",
+    "669", NULL },
+
+  { "tables",
+    "(do (let tab (table)) (let i 0) (let sum 0) (let round 0)"
+    "  (while (< i 1000) (tabset tab i i) (tabset tab (list i) i) (= i (+ i 1)))"
+    "  (while (< round 10) (= i 0)"
+    "    (while (< i 1000) (= sum (+ sum (tabget tab i))) (= i (+ i 1)))"
+    "    (= round (+ round 1)))"
+    "  sum)",
+    "4995000", NULL },
+
+  { "arrays", NULL, "84690", genarrays },
+
+  { "cfuncs",
+    /* a host function called in a loop, as an argv cfunc */
+    "(do (let i 0) (let sum 0)"
+    "  (while (< i 20000) (= sum (+ sum (clamp (- i 10000) -50 50)))"
+    "    (= i (+ i 1)))"
+    "  sum)",
+    "-50", NULL },
+
+  { NULL, NULL, NULL, NULL }
+};
+
+
+static const char *arraysrc[] = {
+  "(do (let sum 0) (let py 0) (let n 120)",
+  "  (let x (arrseq (makearr n) 0 1)) (let x0 (makearr n)) (let y0 (makearr n))",
+  "  (let x1 (makearr n)) (let t (makearr n)) (let in (makearr n))",
+  "  (let iters (makearr n))",
+  "  (arrsub x (arrdiv x x 40) 2)",
+  "  (while (< py 60)",
+  "    (let y (- (/ py 30) 1)) (let iter 0)",
+  "    (arradd x0 x 0) (arrfill y0 y) (arrfill iters 0)",
+  "    (while (< iter 32)",
+  "      (arrmul t x0 x0) (arrmul x1 y0 y0)",
+  "      (arrlte in (arradd in t x1) 4) (arradd iters iters in)",
+  "      (arradd x1 (arrsub x1 t x1) x)",
+  "      (arradd t (arrmul t (arrmul t x0 2) y0) y)",
+  "      (arrsel y0 in t y0) (arrsel x0 in x1 x0)",
+  "      (= iter (+ iter 1)))",
+  "    (= sum (+ sum (arrsum iters))) (= py (+ py 1)))",
+  "  sum)",
+  NULL
+};
+
+
+static char* genarrays(void) {
+  /* the "float" workload a row at a time, escaped points left as they are;
+  ** joined here, as one literal would be too long for C89 */
+  const char **line;
+  size_t n = 1;
+  char *text;
+  for (line = arraysrc; *line; line++) { n += strlen(*line); }
+  text = malloc(n);
+  *text = '\0';
+  for (line = arraysrc; *line; line++) { strcat(text, *line); }
+  return text;
+}
+
+
+static char* genstrings(void) {
+  /* long string literals, each read twice and compared */
+  int i, j, n;
+  char *text = malloc(300 * 3100 + 64), *p = text;
+  p += sprintf(p, "(= ok t)");
+  for (i = 0; i < 300; i++) {
+    n = (i * 37) % 1500 + 1;
+    for (j = 0; j < 2; j++) {
+      p += sprintf(p, j ? "(= ok (and ok (is s \"" : "(= s \"");
+      memset(p, 'a' + i % 26, n);
+      p += n;
+      p += sprintf(p, j ? "\")))" : "\")");
+    }
+  }
+  sprintf(p, "ok");
+  return text;
+}
+
+
+static char* gensymbols(void) {
+  /* 3000 distinct symbols, each read once to intern and once to look up */
+  int i, j, k;
+  char *text = malloc(2 * 30 * (100 * 10 + 16) + 64), *p = text;
+  for (k = 0; k < 2; k++) {
+    for (i = 0; i < 30; i++) {
+      p += sprintf(p, "(quote (");
+      for (j = 0; j < 100; j++) { p += sprintf(p, "s%d_%d ", i, j); }
+      p += sprintf(p, "))\n");
+    }
+  }
+  sprintf(p, "(is (quote s29_99) (car (quote (s29_99))))");
+  return text;
+}
+
+
+static fe_Object* f_clamp(fe_Context *ctx, int argc, fe_Object **argv) {
+  fe_Number x = fe_tonumber(ctx, argv[0]);
+  fe_Number lo = fe_tonumber(ctx, argv[1]), hi = fe_tonumber(ctx, argv[2]);
+  (void) argc;
+  return fe_number(ctx, x < lo ? lo : x > hi ? hi : x);
+}
+
+
+static jmp_buf errbuf;
+static const char *errmsg;
+
+static void onerror(fe_Context *ctx, const char *msg, fe_Object *cl) {
+  (void) ctx, (void) cl;
+  errmsg = msg;
+  longjmp(errbuf, -1);
+}
+
+
+static char readstr(fe_Context *ctx, void *udata) {
+  Reader *r = udata;
+  (void) ctx;
+  return *r->p ? *r->p++ : '\0';
+}
+
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static int run(Workload *w, int compile, void *heap, Result *res) {
+  fe_Context *ctx;
+  fe_Object *obj, *volatile last = NULL;
+  Reader r;
+  int gc;
+  double t = now();
+
+  ctx = fe_open(heap, HEAPSIZE);
+  fe_handlers(ctx)->error = onerror;
+  if (setjmp(errbuf)) { return -1; }
+  fe_set(ctx, fe_symbol(ctx, "clamp"), fe_cfuncv(ctx, f_clamp));
+  gc = fe_savegc(ctx);
+  r.p = w->src;
+  while ((obj = fe_read(ctx, readstr, &r))) {
+    last = compile ? fe_run(ctx, fe_compile(ctx, obj)) : fe_eval(ctx, obj);
+    fe_restoregc(ctx, gc);
+    fe_pushgc(ctx, last);
+  }
+  fe_tostring(ctx, last, res->result, sizeof(res->result));
+  fe_stats(ctx, &res->stats);
+  fe_close(ctx);
+  res->time = now() - t;
+  return 0;
+}
+
+
+static int cmptime(const void *a, const void *b) {
+  double x = ((const Result*) a)->time, y = ((const Result*) b)->time;
+  return x < y ? -1 : x > y;
+}
+
+
+static int selected(const char *name, char **names, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (!strcmp(names[i], name)) { return 1; }
+  }
+  return n == 0;
+}
+
+
+int main(int argc, char **argv) {
+  static const char *modes[] = { "eval", "compiled" };
+  Result res[MAXRUNS];
+  fe_Stats *st;
+  Workload *w;
+  FILE *out = NULL;
+  int runs = 5, warmups = 1, failed = 0, i, mode;
+  void *heap = malloc(HEAPSIZE);
+
+  for (argc--, argv++; argc > 1 && argv[0][0] == '-'; argc -= 2, argv += 2) {
+    if (!strcmp(argv[0], "-n")) { runs = atoi(argv[1]); }
+    else if (!strcmp(argv[0], "-w")) { warmups = atoi(argv[1]); }
+    else if (!strcmp(argv[0], "-o")) { out = fopen(argv[1], "w"); }
+    else { break; }
+  }
+  if (runs < 1 || runs > MAXRUNS) { runs = runs < 1 ? 1 : MAXRUNS; }
+
+  printf("%-10s %-9s %10s %10s %10s %7s %7s %9s\n", "workload", "mode",
+         "best ms", "median ms", "allocs", "cycles", "stalls", "peak live");
+  if (out) {
+    fprintf(out, "workload\tmode\tbest_ms\tmedian_ms\tallocs\tcycles\t"
+                 "stalls\tpeak\n");
+  }
+
+  for (w = workloads; w->name; w++) {
+    if (!selected(w->name, argv, argc)) { continue; }
+    if (w->gen) { w->src = w->gen(); }
+    for (mode = 0; mode < 2; mode++) {
+      for (i = 0; i < warmups; i++) { run(w, mode, heap, &res[0]); }
+      for (i = 0; i < runs; i++) {
+        if (run(w, mode, heap, &res[i])) {
+          fprintf(stderr, "%s (%s): error: %s\n", w->name, modes[mode], errmsg);
+          failed = 1;
+          break;
+        }
+      }
+      if (i < runs) { continue; }
+      if (strcmp(res[0].result, w->expect)) {
+        fprintf(stderr, "%s (%s): expected %s, got %s\n",
+                w->name, modes[mode], w->expect, res[0].result);
+        failed = 1;
+      }
+      qsort(res, runs, sizeof(Result), cmptime);
+      st = &res[0].stats;
+      printf("%-10s %-9s %10.2f %10.2f %10lu %7lu %7lu %9d\n", w->name,
+             modes[mode], res[0].time * 1e3, res[runs / 2].time * 1e3,
+             st->allocs, st->cycles, st->stalls, st->live_max);
+      if (out) {
+        fprintf(out, "%s\t%s\t%.3f\t%.3f\t%lu\t%lu\t%lu\t%d\n", w->name,
+                modes[mode], res[0].time * 1e3, res[runs / 2].time * 1e3,
+                st->allocs, st->cycles, st->stalls, st->live_max);
+      }
+    }
+    if (w->gen) { free((char*) w->src); }
+  }
+
+  if (out) { fclose(out); }
+  free(heap);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,96 @@
+/*
+** Interleaves many script tasks on one thread, each a coroutine which
+** yields after every step, resuming them in turn until all are done.
+** Reports the heap needed while every task is suspended, per task, and
+** the time per resume and yield.
+**
+** gcc bench/coroutines.c src/fe.c -Isrc -O3 -o coroutines_bench
+*/
+
+#include <string.h>
+#include <time.h>
+#include "fe.h"
+
+#define STEPS 100
+
+static const char *task =
+  "(fn (id)"
+  "  (let i 0)"
+  "  (let sum 0)"
+  "  (while (< i %d)"
+  "    (= i (+ i 1))"
+  "    (= sum (+ sum (yield i))))"
+  "  sum)";
+
+static size_t heap, heap_max;
+
+
+static void* alloc(void *udata, void *ptr, size_t size) {
+  /* every block is freed with its size still ahead of it */
+  size_t *blk = ptr ? (size_t*) ptr - 1 : NULL;
+  (void) udata;
+  if (blk) { heap -= *blk; free(blk); }
+  if (!size) { return NULL; }
+  blk = malloc(sizeof(size_t) + size);
+  *blk = size;
+  heap += size;
+  if (heap > heap_max) { heap_max = heap; }
+  return blk + 1;
+}
+
+
+static void run(int count) {
+  char src[256];
+  const char *s = src;
+  size_t len;
+  int i, gc, live, switches = 0;
+  fe_Context *ctx;
+  fe_Object *fn, *tasks, *co, **init;
+  clock_t t;
+
+  heap = heap_max = 0;
+  ctx = fe_openalloc(alloc, NULL, 64 * 1024);
+
+  /* create `count` tasks from one compiled fn, kept alive by a vector */
+  sprintf(src, task, STEPS);
+  len = strlen(src);
+  fn = fe_run(ctx, fe_compile(ctx, fe_readbuf(ctx, &s, &len)));
+  init = malloc(count * sizeof(fe_Object*));
+  for (i = 0; i < count; i++) { init[i] = fn; }
+  tasks = fe_vector(ctx, init, count);
+  free(init);
+  gc = fe_savegc(ctx);
+  for (i = 0; i < count; i++) {
+    fe_vecset(ctx, tasks, i, fe_coroutine(ctx, fn));
+    fe_restoregc(ctx, gc);
+  }
+
+  /* resume each task in turn, passing it back what it yielded */
+  t = clock();
+  for (live = count; live > 0;) {
+    for (live = i = 0; i < count; i++) {
+      co = fe_vecget(ctx, tasks, i);
+      if (fe_costatus(ctx, co) == FE_CDEAD) { continue; }
+      fe_resume(ctx, co, fe_number(ctx, 1));
+      fe_restoregc(ctx, gc);
+      switches++;
+      live += fe_costatus(ctx, co) != FE_CDEAD;
+    }
+  }
+  t = clock() - t;
+
+  printf("%10d %12.1f %12.1f %12.1f\n", count, heap_max / 1024.0,
+         (double) heap_max / count,
+         (double) t / CLOCKS_PER_SEC * 1e9 / switches);
+  fe_close(ctx);
+}
+
+
+int main(void) {
+  int count;
+  printf("%10s %12s %12s %12s\n", "tasks", "heap KB", "bytes/task", "ns/switch");
+  for (count = 100; count <= 100000; count *= 10) {
+    run(count);
+  }
+  return EXIT_SUCCESS;
+}
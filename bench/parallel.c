@@ -0,0 +1,222 @@
+/*
+** Runs a batch of scripts on a pool of worker threads, each script in a
+** context of its own, and writes each script's output in order once the
+** batch is done. Contexts share no state, so the batch scales with the
+** number of cores; `-t` instead times the batch at 1, 2, 4... threads up
+** to the pool size and reports the speedup over one thread.
+**
+** gcc bench/parallel.c src/fe.c -Isrc -O3 -pthread -o fe_parallel
+** ./fe_parallel [-j threads] [-n repeats] [-c] [-t] file...
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fe.h"
+
+#define HEAPSIZE   (1024 * 1024)
+#define MAXTHREADS 256
+
+typedef struct {
+  const char *src;
+  size_t len;
+  char *out;
+  size_t outlen, outcap;
+  char err[128];
+} Job;
+
+/* the heap comes first so that a worker can be found from its context */
+typedef struct {
+  char heap[HEAPSIZE];
+  jmp_buf errbuf;
+  Job *job;
+} Worker;
+
+typedef struct {
+  Job *jobs;
+  int njobs, next, compile;
+  pthread_mutex_t lock;
+} Pool;
+
+
+static void append(Job *job, const char *data, size_t len) {
+  if (job->outlen + len > job->outcap) {
+    job->outcap = (job->outlen + len) * 2;
+    job->out = realloc(job->out, job->outcap);
+  }
+  memcpy(job->out + job->outlen, data, len);
+  job->outlen += len;
+}
+
+
+static void writeblock(fe_Context *ctx, void *udata, const char *data, int len) {
+  (void) ctx;
+  append(udata, data, len);
+}
+
+
+static fe_Object* f_print(fe_Context *ctx, fe_Object *arg) {
+  /* `print` writes to the job's output rather than stdout */
+  Job *job = ((Worker*) ctx)->job;
+  while (!fe_isnil(ctx, arg)) {
+    fe_writeblock(ctx, fe_nextarg(ctx, &arg), writeblock, job, 0);
+    if (!fe_isnil(ctx, arg)) { append(job, " ", 1); }
+  }
+  append(job, "\n", 1);
+  return fe_bool(ctx, 0);
+}
+
+
+static void onerror(fe_Context *ctx, const char *msg, fe_Object *cl) {
+  Worker *w = (Worker*) ctx;
+  (void) cl;
+  /* the message may be on the stack being unwound, so keep a copy */
+  strncpy(w->job->err, msg, sizeof(w->job->err) - 1);
+  longjmp(w->errbuf, -1);
+}
+
+
+static void run(Worker *w, Job *job, int compile) {
+  fe_Context *ctx = fe_open(w->heap, HEAPSIZE);
+  const char *src = job->src;
+  size_t len = job->len;
+  fe_Object *obj;
+  int gc;
+
+  w->job = job;
+  job->outlen = 0;
+  job->err[0] = '\0';
+  fe_handlers(ctx)->error = onerror;
+  if (setjmp(w->errbuf)) { fe_close(ctx); return; }
+  fe_set(ctx, fe_symbol(ctx, "print"), fe_cfunc(ctx, f_print));
+  gc = fe_savegc(ctx);
+  while ((obj = fe_readbuf(ctx, &src, &len))) {
+    if (compile) { fe_run(ctx, fe_compile(ctx, obj)); }
+    else { fe_eval(ctx, obj); }
+    fe_restoregc(ctx, gc);
+  }
+  fe_close(ctx);
+}
+
+
+static void* worker(void *udata) {
+  Pool *pool = udata;
+  Worker *w = malloc(sizeof(Worker));
+  int i;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (i >= pool->njobs) { break; }
+    run(w, &pool->jobs[i], pool->compile);
+  }
+  free(w);
+  return NULL;
+}
+
+
+static double runpool(Pool *pool, int nthreads) {
+  pthread_t threads[MAXTHREADS];
+  struct timespec t0, t1;
+  int i;
+  pool->next = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, worker, pool);
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+}
+
+
+static char* readfile(const char *filename, size_t *len) {
+  FILE *fp = fopen(filename, "rb");
+  char *data;
+  long n;
+  if (!fp) { return NULL; }
+  fseek(fp, 0, SEEK_END);
+  n = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  data = malloc(n + 1);
+  *len = fread(data, 1, n, fp);
+  fclose(fp);
+  return data;
+}
+
+
+int main(int argc, char **argv) {
+  Pool pool;
+  char **files;
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN), repeats = 1, timing = 0;
+  int nfiles, failed = 0, i, n;
+  double base = 0, t;
+
+  memset(&pool, 0, sizeof(pool));
+  for (argc--, argv++; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+    if (!strcmp(argv[0], "-c")) { pool.compile = 1; }
+    else if (!strcmp(argv[0], "-t")) { timing = 1; }
+    else if (!strcmp(argv[0], "-j") && argc > 1) { nthreads = atoi(*++argv); argc--; }
+    else if (!strcmp(argv[0], "-n") && argc > 1) { repeats = atoi(*++argv); argc--; }
+    else { break; }
+  }
+  if (argc < 1) {
+    fprintf(stderr, "usage: fe_parallel [-j threads] [-n repeats] [-c] [-t] file...\n");
+    return EXIT_FAILURE;
+  }
+  if (nthreads < 1 || nthreads > MAXTHREADS) {
+    nthreads = nthreads < 1 ? 1 : MAXTHREADS;
+  }
+  if (repeats < 1) { repeats = 1; }
+
+  /* the batch is every file, `repeats` times over */
+  files = argv;
+  nfiles = argc;
+  pool.njobs = nfiles * repeats;
+  pool.jobs = calloc(pool.njobs, sizeof(Job));
+  for (i = 0; i < nfiles; i++) {
+    char *src = readfile(files[i], &pool.jobs[i].len);
+    if (!src) {
+      fprintf(stderr, "could not open %s\n", files[i]);
+      return EXIT_FAILURE;
+    }
+    for (n = 0; n < repeats; n++) {
+      pool.jobs[n * nfiles + i].src = src;
+      pool.jobs[n * nfiles + i].len = pool.jobs[i].len;
+    }
+  }
+  pthread_mutex_init(&pool.lock, NULL);
+
+  if (timing) {
+    printf("%8s %10s %8s\n", "threads", "ms", "speedup");
+    for (n = 1;; n *= 2) {
+      n = n < nthreads ? n : nthreads;
+      t = runpool(&pool, n);
+      if (n == 1) { base = t; }
+      printf("%8d %10.2f %8.2f\n", n, t * 1e3, base / t);
+      if (n == nthreads) { break; }
+    }
+  } else {
+    runpool(&pool, nthreads);
+  }
+
+  for (i = 0; i < pool.njobs; i++) {
+    Job *job = &pool.jobs[i];
+    if (!timing) { fwrite(job->out, 1, job->outlen, stdout); }
+    if (*job->err) {
+      fprintf(stderr, "%s: error: %s\n", files[i % nfiles], job->err);
+      failed = 1;
+    }
+    free(job->out);
+  }
+  for (i = 0; i < nfiles; i++) { free((char*) pool.jobs[i].src); }
+  free(pool.jobs);
+  pthread_mutex_destroy(&pool.lock);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+/*
+** Measures fe_read() throughput as the number of interned symbols grows,
+** in a fixed 64MB heap and in one grown from 16KB; the time per symbol
+** should stay flat from 100 to 100k symbols in both.
+**
+** gcc bench/symbols.c src/fe.c -Isrc -O3 -o symbols_bench
+*/
+
+#include <string.h>
+#include <time.h>
+#include "fe.h"
+
+typedef struct { const char *p; } Reader;
+
+static char readstr(fe_Context *ctx, void *udata) {
+  Reader *r = udata;
+  (void) ctx;
+  return *r->p ? *r->p++ : '\0';
+}
+
+
+static void* alloc(void *udata, void *ptr, size_t size) {
+  (void) udata;
+  if (size == 0) { free(ptr); return NULL; }
+  return malloc(size);
+}
+
+
+static double run(int count, int size, int grow) {
+  int i, gc;
+  char *text, *p;
+  void *data;
+  fe_Context *ctx;
+  Reader r;
+  clock_t t;
+
+  /* build a script containing `count` distinct symbols */
+  text = p = malloc(count * 16 + 1);
+  for (i = 0; i < count; i++) {
+    p += sprintf(p, "sym%d ", i);
+  }
+
+  if (grow) {
+    data = NULL;
+    ctx = fe_openalloc(alloc, NULL, size);
+  } else {
+    data = malloc(size);
+    ctx = fe_open(data, size);
+  }
+  gc = fe_savegc(ctx);
+
+  /* read every symbol twice: once to intern, once to look it up again */
+  t = clock();
+  for (i = 0; i < 2; i++) {
+    r.p = text;
+    while (fe_read(ctx, readstr, &r)) {
+      fe_restoregc(ctx, gc);
+    }
+  }
+  t = clock() - t;
+
+  fe_close(ctx);
+  free(data);
+  free(text);
+  return (double) t / CLOCKS_PER_SEC * 1e9 / (count * 2);
+}
+
+
+int main(void) {
+  int count;
+  printf("%10s %12s %12s\n", "symbols", "ns/symbol", "grown");
+  for (count = 100; count <= 100000; count *= 10) {
+    printf("%10d %12.1f %12.1f\n", count, run(count, 64 * 1024 * 1024, 0),
+           run(count, 16 * 1024, 1));
+  }
+  return EXIT_SUCCESS;
+}
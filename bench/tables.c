@@ -0,0 +1,64 @@
+/*
+** Measures fe_tabget() lookups as the number of entries in a table grows;
+** the time per lookup should stay flat from 10 to 100k entries.
+**
+** gcc bench/tables.c src/fe.c -Isrc -O3 -o tables_bench
+*/
+
+#include <time.h>
+#include "fe.h"
+
+#define LOOKUPS 1000000
+
+
+static double run(int count, int size) {
+  int i, j, gc, iter = 0;
+  unsigned seed = 1;
+  char name[32];
+  void *data;
+  fe_Context *ctx;
+  fe_Object *tab, **keys, *v;
+  clock_t t;
+
+  data = malloc(size);
+  ctx = fe_open(data, size);
+  tab = fe_table(ctx);
+  gc = fe_savegc(ctx);
+
+  /* fill a table with `count` string keys */
+  for (i = 0; i < count; i++) {
+    sprintf(name, "key%d", i);
+    fe_tabset(ctx, tab, fe_string(ctx, name), fe_number(ctx, i));
+    fe_restoregc(ctx, gc);
+  }
+
+  /* take the keys back out, kept alive by the table, and shuffle them */
+  keys = malloc(count * sizeof(fe_Object*));
+  for (i = 0; fe_tabnext(ctx, tab, &iter, &keys[i], &v); i++);
+  for (i = count - 1; i > 0; i--) {
+    seed = seed * 1103515245u + 12345u;
+    j = (seed >> 8) % (i + 1);
+    v = keys[i], keys[i] = keys[j], keys[j] = v;
+  }
+
+  t = clock();
+  for (i = 0; i < LOOKUPS; i++) {
+    fe_tabget(ctx, tab, keys[i % count]);
+  }
+  t = clock() - t;
+
+  fe_close(ctx);
+  free(keys);
+  free(data);
+  return (double) t / CLOCKS_PER_SEC * 1e9 / LOOKUPS;
+}
+
+
+int main(void) {
+  int count;
+  printf("%10s %12s\n", "entries", "ns/lookup");
+  for (count = 10; count <= 100000; count *= 10) {
+    printf("%10d %12.1f\n", count, run(count, 64 * 1024 * 1024));
+  }
+  return EXIT_SUCCESS;
+}
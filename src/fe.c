@@ -20,56 +20,205 @@
 ** IN THE SOFTWARE.
 */
 
+#include <stddef.h>
 #include <string.h>
 #include "fe.h"
 
+#if defined(__AVX__) && !defined(FE_NOSIMD)
+#include <immintrin.h>
+#elif defined(__SSE__) && !defined(FE_NOSIMD)
+#include <xmmintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define prefetch(x)   __builtin_prefetch(x)
+#else
+#define prefetch(x)   ( (void) (x) )
+#endif
+
 #define unused(x)     ( (void) (x) )
 #define car(x)        ( (x)->car.o )
 #define cdr(x)        ( (x)->cdr.o )
 #define tag(x)        ( (x)->car.c )
 #define isnil(x)      ( (x) == &nil )
-#define type(x)       ( tag(x) & 0x1 ? tag(x) >> 2 : FE_TPAIR )
+#define isimm(x)      ( (size_t) (x) & 0x2 )
+#define type(x)       ( isimm(x) ? FE_TNUMBER : tag(x) & 0x1 ? tag(x) >> 2 : FE_TPAIR )
 #define settype(x,t)  ( tag(x) = (t) << 2 | 1 )
-#define number(x)     ( (x)->cdr.n )
+#define number(x)     ( isimm(x) ? immnumber(x) : (x)->cdr.n )
 #define prim(x)       ( (x)->cdr.c )
 #define cfunc(x)      ( (x)->cdr.f )
+#define cfuncv(x)     ( (x)->cdr.v )
+#define isargv(x)     ( ((unsigned char*) strbuf(x))[0] )
+#define costate(x)    ( ((unsigned char*) strbuf(x))[0] )
 #define strbuf(x)     ( &(x)->car.c + 1 )
-
+#define refdepth(x)   ( ((unsigned char*) strbuf(x))[0] )
+#define refslot(x)    ( ((unsigned char*) strbuf(x))[1] )
+#define refcell(x)    ( ((unsigned char*) strbuf(x))[2] )
+#define layparams(x)  ( ((unsigned char*) strbuf(x))[0] )
+#define layrest(x)    ( ((unsigned char*) strbuf(x))[1] )
+#define layslots(x)   ( ((unsigned char*) strbuf(x))[2] )
+#define symlocal(x)   ( ((unsigned char*) strbuf(x))[0] )
+#define capchain(x)   ( ((unsigned char*) strbuf(x))[0] )
+
+#define STRLENBYTES   ( sizeof(int) < sizeof(fe_Object*) ? (int) sizeof(int) : STRBUFSIZE )
+#define IMMNUMBERS    ( sizeof(fe_Number) < sizeof(fe_Object*) )
+#define IMMOFFSET     ( IMMNUMBERS ? sizeof(fe_Object*) - sizeof(fe_Number) : 0 )
+#define IMMSIZE       ( IMMNUMBERS ? sizeof(fe_Number) : 0 )
 #define STRBUFSIZE    ( (int) sizeof(fe_Object*) - 1 )
-#define GCMARKBIT     ( 0x2 )
 #define GCSTACKSIZE   ( 256 )
+#define GCSTACKMAX    ( 4096 )
+#define GRAYSTACKSIZE ( 256 )
+#define GCSTEPWORK    ( 32 )
+#define MARKBITS      ( (int) sizeof(unsigned long) * 8 )
+#define MAXBINDS      ( 256 )
+#define MAXSLOTS      ( 255 )
+#define BYTESCLASSES  ( 32 )
+#define VMSTACKSIZE   ( 512 )
+#define VMFRAMES      ( 128 )
+#define MAXCODE       ( 16384 )
+#define MAXLOCALS     ( 256 )
 
 
 enum {
  P_LET, P_SET, P_IF, P_FN, P_MAC, P_WHILE, P_QUOTE, P_AND, P_OR, P_DO, P_CONS,
  P_CAR, P_CDR, P_SETCAR, P_SETCDR, P_LIST, P_NOT, P_IS, P_ATOM, P_PRINT, P_LT,
- P_LTE, P_ADD, P_SUB, P_MUL, P_DIV, P_MAX
+ P_LTE, P_ADD, P_SUB, P_MUL, P_DIV, P_VECTOR, P_MAKEVEC, P_VECGET, P_VECSET,
+ P_VECLEN, P_TOVEC, P_TOLIST, P_TABLE, P_TABGET, P_TABSET, P_TABDEL, P_TABLEN,
+ P_TABKEYS, P_MAKEARR, P_TOARR, P_ARRGET, P_ARRSET, P_ARRLEN, P_ARRFILL,
+ P_ARRSEQ, P_ARRADD, P_ARRSUB, P_ARRMUL, P_ARRDIV, P_ARRLT, P_ARRLTE, P_ARRSEL,
+ P_ARRSUM, P_ARRMIN, P_ARRMAX, P_ARRDOT, P_COROUTINE, P_RESUME, P_YIELD,
+ P_COSTATUS, P_MAX
 };
 
 static const char *primnames[] = {
   "let", "=", "if", "fn", "mac", "while", "quote", "and", "or", "do", "cons",
   "car", "cdr", "setcar", "setcdr", "list", "not", "is", "atom", "print", "<",
-  "<=", "+", "-", "*", "/"
+  "<=", "+", "-", "*", "/", "vector", "makevec", "vecget", "vecset", "veclen",
+  "tovec", "tolist", "table", "tabget", "tabset", "tabdel", "tablen", "tabkeys",
+  "makearr", "toarr", "arrget", "arrset", "arrlen", "arrfill", "arrseq", "arradd",
+  "arrsub", "arrmul", "arrdiv", "arrlt", "arrlte", "arrsel", "arrsum", "arrmin",
+  "arrmax", "arrdot", "coroutine", "resume", "yield", "costatus"
+};
+
+static const char *costatenames[] = { "suspended", "running", "dead" };
+
+/* the number of arguments taken by each of the bulk array primitives, from
+** arrfill on */
+static const char arrargs[] = { 2, 3, 3, 3, 3, 3, 3, 3, 4, 1, 1, 1, 2 };
+
+/* internal types used by resolved and compiled code; never seen outside of
+** fe.c */
+enum {
+  T_LOCAL = FE_TCOROUTINE + 1, T_GLOBAL, T_LAYOUT, T_CAPTURES, T_CODE, T_BYTES
 };
 
+/* what a local's slot holds: its value, or a cell captured by a flat closure
+** whose car (a slot of an enclosing fn's frame) or cdr (a binding by name or
+** a global) is its value */
+enum { CELL_NONE, CELL_CAR, CELL_CDR };
+enum { LOCAL_NAME = 1, LOCAL_SLOT = 2 };
+
 static const char *typenames[] = {
   "pair", "free", "nil", "number", "symbol", "string",
-  "func", "macro", "prim", "cfunc", "ptr"
+  "func", "macro", "prim", "cfunc", "ptr", "vector", "table", "array",
+  "coroutine", "local", "global", "layout", "captures", "code", "bytes"
 };
 
-typedef union { fe_Object *o; fe_CFunc f; fe_Number n; char c; } Value;
+typedef union {
+  fe_Object *o; fe_CFunc f; fe_CFuncV v; fe_Number n; char c; void *p;
+} Value;
 
 struct fe_Object { Value car, cdr; };
 
-struct fe_Context {
-  fe_Handlers handlers;
-  fe_Object *gcstack[GCSTACKSIZE];
-  int gcstack_idx;
+/* a table's slot; the key is NULL if the slot is empty */
+typedef struct { fe_Object *key, *val; } Entry;
+
+/* a free byte block: its size class and the next free block of that class */
+typedef struct FreeBlock { size_t cls; struct FreeBlock *next; } FreeBlock;
+
+/* a compiled function; followed in memory by its constants, capture
+** descriptors and code */
+typedef struct {
+  int nk, ncaps, nparams, rest, nslots, maxstack, ncode, toplevel;
+} Proto;
+
+typedef struct { unsigned char *pc; int base, prof; } Frame;
+
+typedef struct {
+  int sp, nframes;
+  Frame frames[VMFRAMES];
+  fe_Object *stack[VMSTACKSIZE];
+} VM;
+
+/* a coroutine; while it is suspended its frames, followed by the part of
+** the vm's stack they use, are kept after this, each frame's base made
+** relative to the start of that part */
+typedef struct {
+  fe_Object *fn, *resumer;
+  int level, depth, prof, nframes, nstack;
+} Coro;
+
+#define bytes(x)      ( (x)->cdr.p )
+#define proto(x)      ( (Proto*) bytes(x) )
+#define PROTOSIZE     ( (sizeof(Proto) + sizeof(void*) - 1) & ~(sizeof(void*) - 1) )
+#define protok(p)     ( (fe_Object**) ((char*) (p) + PROTOSIZE) )
+#define protocaps(p)  ( (int*) (protok(p) + (p)->nk) )
+#define protocode(p)  ( (unsigned char*) (protocaps(p) + (p)->ncaps) )
+#define iscompiled(x) ( type(cdr(cdr(x))) == T_CODE )
+#define strchars(x)   ( (char*) bytes(x) )
+#define vecitems(x)   ( (fe_Object**) bytes(x) )
+#define tabentries(x) ( (Entry*) bytes(x) )
+#define tabcap(x)     ( (int) (bytessize(bytes(x)) / sizeof(Entry)) )
+#define arritems(x)   ( (fe_Number*) bytes(x) )
+#define coro(x)       ( (Coro*) bytes(x) )
+#define coframes(c)   ( (Frame*) ((c) + 1) )
+#define costack(c)    ( (fe_Object**) (coframes(c) + (c)->nframes) )
+
+enum { GC_IDLE, GC_MARK, GC_SWEEP };
+
+typedef struct {
+  fe_Object *key, *name;
+  int parent, child, next;
+  unsigned long counts[3];
+} ProfNode;
+
+typedef struct Arena Arena;
+
+struct Arena {
+  Arena *next;
+  char *end;
+  unsigned long *marks, *holes;
   fe_Object *objects;
   int object_count;
+  char *bytestop;
+  int blocks, holecount;
+  int gcscan, gctop, gctail;
+};
+
+struct fe_Context {
+  fe_Handlers handlers;
+  fe_Object **gcstack, *gcstackinit[GCSTACKSIZE];
+  int gcstack_idx, gcstack_cap;
+  fe_Object **gray, *grayinit[GRAYSTACKSIZE];
+  int ngray, graycap, grayoverflow;
+  int gcstate, gcwait, gcsym, gctails, gclive;
+  int gcmarked, gcpeak, gcstack_max, calldepth, calldepth_max;
+  unsigned long gcallocs, gccycles, gcwork, gcstalls;
+  ProfNode *prof;
+  int profcap, profcount, profcur;
+  unsigned long profallocs;
+  volatile int proftick;
+  Arena *arenas, *gcarena;
+  fe_AllocFn alloc;
+  void *udata;
+  FreeBlock *bytesfree[BYTESCLASSES];
+  unsigned long bytesmask;
+  fe_Object *vm, *co;
+  int yielding;
   fe_Object *calllist;
   fe_Object *freelist;
-  fe_Object *symlist;
+  fe_Object **symtab;
+  int symtab_size, symcount;
   fe_Object *t;
   int nextchr;
 };
@@ -77,6 +226,46 @@ struct fe_Context {
 static fe_Object nil = {{ (void*) (FE_TNIL << 2 | 1) }, { NULL }};
 
 
+/* if a number fits in a pointer alongside a tag byte it is stored in the
+** pointer itself rather than in an object: the number's bytes are shifted
+** into the pointer's value above the tag, which sets the second lowest bit,
+** never set in a pointer to a real object. Building the value arithmetically
+** keeps the tag in the low bits whatever the host's byte order; a number the
+** size of an unsigned int is moved as one, else a byte at a time */
+
+static fe_Object* immobject(fe_Number n) {
+  unsigned char b[sizeof(fe_Number)];
+  unsigned u;
+  size_t v = 0;
+  int i;
+  if (sizeof(fe_Number) == sizeof(unsigned)) {
+    memcpy(&u, &n, sizeof(u));
+    v = u;
+  } else {
+    memcpy(b, &n, IMMSIZE);
+    for (i = 0; i < (int) IMMSIZE; i++) { v = v << 8 | b[i]; }
+  }
+  return (fe_Object*) (v << IMMOFFSET * 8 | 0x2);
+}
+
+
+static fe_Number immnumber(fe_Object *obj) {
+  unsigned char b[sizeof(fe_Number)];
+  unsigned u;
+  size_t v = (size_t) obj >> IMMOFFSET * 8;
+  fe_Number n = 0;
+  int i;
+  if (sizeof(fe_Number) == sizeof(unsigned)) {
+    u = v;
+    memcpy(&n, &u, sizeof(u));
+  } else {
+    for (i = IMMSIZE; i--; v >>= 8) { b[i] = v & 0xff; }
+    memcpy(&n, b, IMMSIZE);
+  }
+  return n;
+}
+
+
 fe_Handlers* fe_handlers(fe_Context *ctx) {
   return &ctx->handlers;
 }
@@ -86,6 +275,20 @@ void fe_error(fe_Context *ctx, const char *msg) {
   fe_Object *cl = ctx->calllist;
   /* reset context state */
   ctx->calllist = &nil;
+  ctx->calldepth = 0;
+  ctx->profcur = 0;
+  if (ctx->vm) {
+    VM *vm = bytes(ctx->vm);
+    vm->sp = vm->nframes = 0;
+  }
+  /* coroutines which were running lose their frames with the vm's */
+  while (ctx->co) {
+    fe_Object *co = ctx->co;
+    ctx->co = coro(co)->resumer;
+    costate(co) = FE_CDEAD;
+    coro(co)->nframes = coro(co)->nstack = 0;
+  }
+  ctx->yielding = 0;
   /* do error handler */
   if (ctx->handlers.error) { ctx->handlers.error(ctx, msg, cl); }
   /* error handler returned -- print error and traceback, exit */
@@ -132,11 +335,16 @@ int fe_isnil(fe_Context *ctx, fe_Object *obj) {
 }
 
 
+static void growgcstack(fe_Context *ctx);
+
 void fe_pushgc(fe_Context *ctx, fe_Object *obj) {
-  if (ctx->gcstack_idx == GCSTACKSIZE) {
-    fe_error(ctx, "gc stack overflow");
-  }
+  /* the stack grows once only its last slot is left, rather than before
+  ** pushing, such that `obj` is kept alive should growing collect garbage */
   ctx->gcstack[ctx->gcstack_idx++] = obj;
+  if (ctx->gcstack_idx >= ctx->gcstack_cap - 1) { growgcstack(ctx); }
+  if (ctx->gcstack_idx > ctx->gcstack_max) {
+    ctx->gcstack_max = ctx->gcstack_idx;
+  }
 }
 
 
@@ -150,637 +358,4391 @@ int fe_savegc(fe_Context *ctx) {
 }
 
 
-void fe_mark(fe_Context *ctx, fe_Object *obj) {
-  fe_Object *car;
-begin:
-  if (tag(obj) & GCMARKBIT) { return; }
-  car = car(obj); /* store car before modifying it with GCMARKBIT */
-  tag(obj) |= GCMARKBIT;
+/* The heap is made up of one or more arenas: the memory region given to
+** fe_open(), and, if an allocator was given, any arenas added since. Each
+** arena has a mark bitmap and a hole bitmap followed by its objects, which
+** grow up from the bottom while byte blocks grow down from the top. A hole
+** is a run of free objects lent out as a byte block when no other space is
+** left; its bits are set for as long as it is lent */
+
+static Arena* initarena(void *ptr, size_t size) {
+  Arena *a = ptr;
+  size_t n;
+  memset(a, 0, sizeof(Arena));
+  a->end = (char*) ptr + size;
+  ptr = a + 1;
+  size -= sizeof(Arena);
+  /* one mark bit and one hole bit for each object the arena could hold */
+  n = (size / sizeof(fe_Object) / MARKBITS + 1) * sizeof(unsigned long);
+  a->marks = (unsigned long*) ptr;
+  a->holes = (unsigned long*) ((char*) ptr + n);
+  memset(a->marks, 0, n * 2);
+  a->objects = (fe_Object*) ((char*) ptr + n * 2);
+  a->bytestop = (char*) &a->objects[(size - n * 2) / sizeof(fe_Object)];
+  return a;
+}
 
-  switch (type(obj)) {
-    case FE_TPAIR:
-      fe_mark(ctx, car);
-      /* fall through */
-    case FE_TFUNC: case FE_TMACRO: case FE_TSYMBOL: case FE_TSTRING:
-      obj = cdr(obj);
-      goto begin;
 
-    case FE_TPTR:
-      if (ctx->handlers.mark) { ctx->handlers.mark(ctx, obj); }
-      break;
+static Arena* arenaof(fe_Context *ctx, fe_Object *obj) {
+  Arena *a;
+  for (a = ctx->arenas; a; a = a->next) {
+    if (obj >= a->objects && obj < a->objects + a->object_count) { return a; }
   }
+  return NULL;
 }
 
 
-static void collectgarbage(fe_Context *ctx) {
-  int i;
-  /* mark */
-  for (i = 0; i < ctx->gcstack_idx; i++) {
-    fe_mark(ctx, ctx->gcstack[i]);
-  }
-  fe_mark(ctx, ctx->symlist);
-  /* sweep and unmark */
-  for (i = 0; i < ctx->object_count; i++) {
-    fe_Object *obj = &ctx->objects[i];
-    if (type(obj) == FE_TFREE) { continue; }
-    if (~tag(obj) & GCMARKBIT) {
-      if (type(obj) == FE_TPTR && ctx->handlers.gc) {
-        ctx->handlers.gc(ctx, obj);
-      }
-      settype(obj, FE_TFREE);
-      cdr(obj) = ctx->freelist;
-      ctx->freelist = obj;
-    } else {
-      tag(obj) &= ~GCMARKBIT;
-    }
+static Arena* arenaat(fe_Context *ctx, void *ptr) {
+  Arena *a;
+  for (a = ctx->arenas; a; a = a->next) {
+    if ((char*) ptr >= (char*) a && (char*) ptr < a->end) { return a; }
   }
+  return NULL;
 }
 
 
-static int equal(fe_Object *a, fe_Object *b) {
-  if (a == b) { return 1; }
-  if (type(a) != type(b)) { return 0; }
-  if (type(a) == FE_TNUMBER) { return number(a) == number(b); }
-  if (type(a) == FE_TSTRING) {
-    for (; !isnil(a); a = cdr(a), b = cdr(b)) {
-      if (car(a) != car(b)) { return 0; }
-    }
-    return a == b;
-  }
-  return 0;
+static size_t unused_space(Arena *a) {
+  return a->bytestop - (char*) &a->objects[a->object_count];
 }
 
 
-static int streq(fe_Object *obj, const char *str) {
-  while (!isnil(obj)) {
-    int i;
-    for (i = 0; i < STRBUFSIZE; i++) {
-      if (strbuf(obj)[i] != *str) { return 0; }
-      if (*str) { str++; }
-    }
-    obj = cdr(obj);
-  }
-  return *str == '\0';
+static char* arenatop(Arena *a) {
+  /* where the arena's first byte block ends */
+  return (char*) &a->objects[(a->end - (char*) a->objects) / sizeof(fe_Object)];
 }
 
 
-static fe_Object* object(fe_Context *ctx) {
-  fe_Object *obj;
-  /* do gc if freelist has no more objects */
-  if (isnil(ctx->freelist)) {
-    collectgarbage(ctx);
-    if (isnil(ctx->freelist)) { fe_error(ctx, "out of memory"); }
+static int capacity(fe_Context *ctx) {
+  Arena *a;
+  int n = 0;
+  for (a = ctx->arenas; a; a = a->next) {
+    n += (a->bytestop - (char*) a->objects) / sizeof(fe_Object) - a->holecount;
   }
-  /* get object from freelist and push to the gcstack */
-  obj = ctx->freelist;
-  ctx->freelist = cdr(obj);
-  fe_pushgc(ctx, obj);
-  return obj;
+  return n;
 }
 
 
-fe_Object* fe_cons(fe_Context *ctx, fe_Object *car, fe_Object *cdr) {
-  fe_Object *obj = object(ctx);
-  car(obj) = car;
-  cdr(obj) = cdr;
-  return obj;
+static Arena* grow(fe_Context *ctx, size_t need) {
+  /* adds an arena as large as the rest of the heap together, or large
+  ** enough for a byte block of `need` bytes if that's larger */
+  Arena *a, **p;
+  size_t size = 0;
+  void *ptr;
+  if (!ctx->alloc) { return NULL; }
+  for (p = &ctx->arenas; *p; p = &(*p)->next) {
+    size += (*p)->end - (char*) *p;
+  }
+  /* the bitmaps cover the whole arena, their own bytes included */
+  need += sizeof(Arena) + sizeof(fe_Object);
+  need += need / sizeof(fe_Object) / 2 + 4 * sizeof(unsigned long);
+  if (size < need) { size = need; }
+  ptr = ctx->alloc(ctx->udata, NULL, size);
+  if (!ptr) { return NULL; }
+  a = *p = initarena(ptr, size);
+  return a;
 }
 
 
-fe_Object* fe_bool(fe_Context *ctx, int b) {
-  return b ? ctx->t : &nil;
+static void release(fe_Context *ctx) {
+  /* frees arenas (never the first) which hold nothing, as long as no more
+  ** than a quarter of the heap left would be live; the heap grows when half
+  ** of it is live, so it can't go back and forth between the two */
+  Arena *a, **p;
+  FreeBlock **blk;
+  int i, n, cap = capacity(ctx);
+  for (p = &ctx->arenas->next; (a = *p);) {
+    n = (a->bytestop - (char*) a->objects) / sizeof(fe_Object);
+    if (a->object_count || a->blocks || ctx->gclive > (cap - n) / 4) {
+      p = &a->next;
+      continue;
+    }
+    /* drop the arena's free byte blocks from the freelists */
+    for (i = 0; i < BYTESCLASSES; i++) {
+      for (blk = &ctx->bytesfree[i]; *blk;) {
+        if ((char*) *blk >= (char*) a && (char*) *blk < a->end) {
+          *blk = (*blk)->next;
+        } else {
+          blk = &(*blk)->next;
+        }
+      }
+      if (!ctx->bytesfree[i]) { ctx->bytesmask &= ~(1UL << i); }
+    }
+    cap -= n;
+    ctx->gcwait -= n;
+    *p = a->next;
+    ctx->alloc(ctx->udata, a, 0);
+  }
 }
 
 
-fe_Object* fe_number(fe_Context *ctx, fe_Number n) {
-  fe_Object *obj = object(ctx);
-  settype(obj, FE_TNUMBER);
-  number(obj) = n;
-  return obj;
+/* The collector is incremental: once free objects run low a cycle starts
+** and each allocation then does a bounded amount of marking or sweeping.
+** Marking works from a snapshot of the heap taken at the start of the cycle
+** -- the roots are shaded straight away, a store into an existing object
+** shades the value it overwrites and objects allocated while marking are
+** born marked -- so nothing reachable at the snapshot can be missed however
+** the program rearranges things meanwhile. Mark bits are kept in a bitmap
+** beside the objects, so a marked pair's car is never disturbed */
+
+static int ismarked(Arena *a, int i) {
+  return (a->marks[i / MARKBITS] >> (i % MARKBITS)) & 1;
 }
 
 
-static fe_Object* buildstring(fe_Context *ctx, fe_Object *tail, int chr) {
-  if (!tail || strbuf(tail)[STRBUFSIZE - 1] != '\0') {
-    fe_Object *obj = fe_cons(ctx, NULL, &nil);
-    settype(obj, FE_TSTRING);
-    if (tail) {
-      cdr(tail) = obj;
-      ctx->gcstack_idx--;
-    }
-    tail = obj;
-  }
-  strbuf(tail)[strlen(strbuf(tail))] = chr;
-  return tail;
+static int ishole(Arena *a, int i) {
+  return (a->holes[i / MARKBITS] >> (i % MARKBITS)) & 1;
 }
 
 
-fe_Object* fe_string(fe_Context *ctx, const char *str) {
-  fe_Object *obj = buildstring(ctx, NULL, '\0');
-  fe_Object *tail = obj;
-  while (*str) {
-    tail = buildstring(ctx, tail, *str++);
+static void sethole(Arena *a, int i, int n, int hole) {
+  a->holecount += hole ? n : -n;
+  for (; n--; i++) {
+    if (hole) { a->holes[i / MARKBITS] |= 1UL << (i % MARKBITS); }
+    else { a->holes[i / MARKBITS] &= ~(1UL << (i % MARKBITS)); }
   }
-  return obj;
 }
 
 
-fe_Object* fe_symbol(fe_Context *ctx, const char *name) {
-  fe_Object *obj;
-  /* try to find in symlist */
-  for (obj = ctx->symlist; !isnil(obj); obj = cdr(obj)) {
-    if (streq(car(cdr(car(obj))), name)) {
-      return car(obj);
-    }
-  }
-  /* create new object, push to symlist and return */
-  obj = object(ctx);
-  settype(obj, FE_TSYMBOL);
-  cdr(obj) = fe_cons(ctx, fe_string(ctx, name), &nil);
-  ctx->symlist = fe_cons(ctx, obj, ctx->symlist);
-  return obj;
+static size_t bytessize(void *ptr) {
+  return (sizeof(fe_Object) << ((size_t*) ptr)[-1]) - sizeof(size_t);
 }
 
 
-fe_Object* fe_cfunc(fe_Context *ctx, fe_CFunc fn) {
-  fe_Object *obj = object(ctx);
-  settype(obj, FE_TCFUNC);
-  cfunc(obj) = fn;
-  return obj;
+static void setlength(fe_Context *ctx, fe_Object *obj, size_t len) {
+  int i;
+  if (len >> (STRLENBYTES * 8 - 1)) {
+    fe_error(ctx, type(obj) == FE_TSTRING ? "string too long" :
+                  type(obj) == FE_TVECTOR ? "vector too long" :
+                  type(obj) == FE_TARRAY  ? "array too long"  : "table too large");
+  }
+  for (i = 0; i < STRLENBYTES; i++, len >>= 8) {
+    ((unsigned char*) strbuf(obj))[i] = len & 0xff;
+  }
 }
 
 
-fe_Object* fe_ptr(fe_Context *ctx, void *ptr) {
-  fe_Object *obj = object(ctx);
-  settype(obj, FE_TPTR);
-  cdr(obj) = ptr;
-  return obj;
+static int length(fe_Object *obj) {
+  int i, n = 0;
+  for (i = STRLENBYTES; i--;) {
+    n = n << 8 | ((unsigned char*) strbuf(obj))[i];
+  }
+  return n;
 }
 
 
-fe_Object* fe_list(fe_Context *ctx, fe_Object **objs, int n) {
-  fe_Object *res = &nil;
-  while (n--) {
-    res = fe_cons(ctx, objs[n], res);
-  }
-  return res;
+static void setmark(fe_Context *ctx, Arena *a, int i) {
+  a->marks[i / MARKBITS] |= 1UL << (i % MARKBITS);
+  if (i >= a->gctop) { a->gctop = i + 1; }
+  ctx->gclive++;
 }
 
 
-fe_Object* fe_car(fe_Context *ctx, fe_Object *obj) {
-  if (isnil(obj)) { return obj; }
-  return car(checktype(ctx, obj, FE_TPAIR));
+static int growgray(fe_Context *ctx);
+
+static void shade(fe_Context *ctx, fe_Object *obj) {
+  Arena *a;
+  int i;
+  if (isimm(obj) || !(a = arenaof(ctx, obj))) { return; }
+  i = obj - a->objects;
+  if (ismarked(a, i)) { return; }
+  setmark(ctx, a, i);
+  switch (type(obj)) {
+    case FE_TNUMBER: case FE_TSTRING: case FE_TPRIM: case FE_TCFUNC:
+    case T_BYTES:
+      return;
+  }
+  /* if the gray stack is full and can't grow the object stays marked but
+  ** unscanned, and the heap is rescanned for such objects once the stack is
+  ** empty */
+  if (ctx->ngray == ctx->graycap && !growgray(ctx)) {
+    ctx->grayoverflow = 1;
+    ctx->gcarena = ctx->arenas;
+    ctx->gcarena->gcscan = 0;
+    return;
+  }
+  ctx->gray[ctx->ngray++] = obj;
 }
 
 
-fe_Object* fe_cdr(fe_Context *ctx, fe_Object *obj) {
-  if (isnil(obj)) { return obj; }
-  return cdr(checktype(ctx, obj, FE_TPAIR));
+void fe_mark(fe_Context *ctx, fe_Object *obj) {
+  if (ctx->gcstate == GC_MARK) { shade(ctx, obj); }
 }
 
 
-static void writestr(fe_Context *ctx, fe_WriteFn fn, void *udata, const char *s) {
-  while (*s) { fn(ctx, udata, *s++); }
+static void store(fe_Context *ctx, fe_Object **p, fe_Object *v) {
+  /* write barrier: the overwritten value may only be reachable from the
+  ** part of the snapshot that hasn't been marked yet */
+  if (ctx->gcstate == GC_MARK) { shade(ctx, *p); }
+  *p = v;
 }
 
-void fe_write(fe_Context *ctx, fe_Object *obj, fe_WriteFn fn, void *udata, int qt) {
-  char buf[32];
 
+static void scan(fe_Context *ctx, fe_Object *obj) {
+  int i;
   switch (type(obj)) {
-    case FE_TNIL:
-      writestr(ctx, fn, udata, "nil");
+    case FE_TPAIR:
+      shade(ctx, car(obj));
+      /* fall through */
+    case FE_TFUNC: case FE_TMACRO: case FE_TSYMBOL: case T_LOCAL:
+    case T_GLOBAL: case T_LAYOUT: case T_CAPTURES:
+      shade(ctx, cdr(obj));
       break;
 
-    case FE_TNUMBER:
-      sprintf(buf, "%.7g", number(obj));
-      writestr(ctx, fn, udata, buf);
+    case FE_TPTR:
+      if (ctx->handlers.mark) { ctx->handlers.mark(ctx, obj); }
       break;
 
-    case FE_TPAIR:
-      fn(ctx, udata, '(');
-      for (;;) {
-        fe_write(ctx, car(obj), fn, udata, 1);
-        obj = cdr(obj);
-        if (type(obj) != FE_TPAIR) { break; }
-        fn(ctx, udata, ' ');
-      }
-      if (!isnil(obj)) {
-        writestr(ctx, fn, udata, " . ");
-        fe_write(ctx, obj, fn, udata, 1);
+    case FE_TVECTOR:
+      if (!bytes(obj)) { break; }
+      /* shading an item reads it, so fetch those a few items on early */
+      for (i = 0; i < length(obj); i++) {
+        if (i + 4 < length(obj)) { prefetch(vecitems(obj)[i + 4]); }
+        shade(ctx, vecitems(obj)[i]);
       }
-      fn(ctx, udata, ')');
       break;
 
-    case FE_TSYMBOL:
-      fe_write(ctx, car(cdr(obj)), fn, udata, 0);
+    case FE_TTABLE:
+      if (!bytes(obj)) { break; }
+      for (i = tabcap(obj); i--;) {
+        Entry *e = &tabentries(obj)[i];
+        if (e->key) { shade(ctx, e->key); shade(ctx, e->val); }
+      }
       break;
 
-    case FE_TSTRING:
-      if (qt) { fn(ctx, udata, '"'); }
-      while (!isnil(obj)) {
-        int i;
-        for (i = 0; i < STRBUFSIZE && strbuf(obj)[i]; i++) {
-          if (qt && strbuf(obj)[i] == '"') { fn(ctx, udata, '\\'); }
-          fn(ctx, udata, strbuf(obj)[i]);
-        }
-        obj = cdr(obj);
+    case T_CODE:
+      if (!bytes(obj)) { break; }
+      for (i = 0; i < proto(obj)->nk; i++) {
+        shade(ctx, protok(proto(obj))[i]);
       }
-      if (qt) { fn(ctx, udata, '"'); }
       break;
 
-    default:
-      sprintf(buf, "[%s %p]", typenames[type(obj)], (void*) obj);
-      writestr(ctx, fn, udata, buf);
+    case FE_TCOROUTINE:
+      if (!bytes(obj)) { break; }
+      if (coro(obj)->fn) { shade(ctx, coro(obj)->fn); }
+      for (i = 0; i < coro(obj)->nstack; i++) {
+        shade(ctx, costack(coro(obj))[i]);
+      }
       break;
   }
 }
 
 
-static void writefp(fe_Context *ctx, void *udata, char chr) {
-  unused(ctx);
-  fputc(chr, udata);
+static void pushbytes(fe_Context *ctx, void *ptr, int cls) {
+  FreeBlock *blk = ptr;
+  blk->cls = cls;
+  blk->next = ctx->bytesfree[cls];
+  ctx->bytesfree[cls] = blk;
+  ctx->bytesmask |= 1UL << cls;
 }
 
-void fe_writefp(fe_Context *ctx, fe_Object *obj, FILE *fp) {
-  fe_write(ctx, obj, writefp, fp, 0);
+
+static void freebytes(fe_Context *ctx, void *ptr) {
+  size_t *blk = (size_t*) ptr - 1;
+  arenaat(ctx, blk)->blocks--;
+  pushbytes(ctx, blk, *blk);
 }
 
 
-typedef struct { char *p; int n; } CharPtrInt;
+static FreeBlock* sortblocks(FreeBlock *list, int n) {
+  /* merge sorts a list of `n` blocks by address, lowest first */
+  FreeBlock *a, *b, *res, **tail = &res;
+  int i;
+  if (n < 2) { return list; }
+  for (i = 1, b = list; i < n / 2; i++) { b = b->next; }
+  a = list;
+  list = b->next;
+  b->next = NULL;
+  a = sortblocks(a, n / 2);
+  b = sortblocks(list, n - n / 2);
+  while (a && b) {
+    if (a < b) { *tail = a, a = a->next; } else { *tail = b, b = b->next; }
+    tail = &(*tail)->next;
+  }
+  *tail = a ? a : b;
+  return res;
+}
 
-static void writebuf(fe_Context *ctx, void *udata, char chr) {
-  CharPtrInt *x = udata;
-  unused(ctx);
-  if (x->n) { *x->p++ = chr; x->n--; }
+
+#define RUN ( (size_t) 1 << (sizeof(size_t) * 8 - 1) )
+
+static void mergebytes(fe_Context *ctx) {
+  /* joins each run of neighbouring free byte blocks, gives a run left at the
+  ** bottom of an arena's blocks back to its objects, and frees the rest as
+  ** the largest blocks which fit, highest first on each list such that new
+  ** blocks keep clear of the bottom. A run in a hole never reaches past the
+  ** hole. While this runs a free block's class is swapped for the size of
+  ** its run marked by RUN, or 0 once it has been joined to the run below it */
+  FreeBlock *all = NULL, *runs = NULL, *blk, *next, *up;
+  Arena *a;
+  size_t n;
+  int i, nruns = 0;
+  for (i = 0; i < BYTESCLASSES; i++) {
+    for (blk = ctx->bytesfree[i]; blk; blk = next) {
+      next = blk->next;
+      blk->cls = (sizeof(fe_Object) << blk->cls) | RUN;
+      blk->next = all;
+      all = blk;
+    }
+    ctx->bytesfree[i] = NULL;
+  }
+  ctx->bytesmask = 0;
+  for (blk = all; blk; blk = blk->next) {
+    if (!blk->cls) { continue; }
+    a = arenaat(ctx, blk);
+    for (;;) {
+      up = (FreeBlock*) ((char*) blk + (blk->cls & ~RUN));
+      if ((char*) up == arenatop(a)) { break; }
+      if ((char*) blk < a->bytestop && ((char*) up >= a->bytestop ||
+          !ishole(a, (fe_Object*) up - a->objects))) { break; }
+      if (!(up->cls & RUN)) { break; }
+      blk->cls += up->cls & ~RUN;
+      up->cls = 0;
+    }
+  }
+  for (a = ctx->arenas; a; a = a->next) {
+    blk = (FreeBlock*) a->bytestop;
+    if ((char*) blk < arenatop(a) && (blk->cls & RUN)) {
+      a->bytestop += blk->cls & ~RUN;
+      blk->cls = 0;
+    }
+  }
+  /* gather the runs first, as freeing one writes over the blocks in it */
+  for (blk = all; blk; blk = next) {
+    next = blk->next;
+    if (blk->cls) { blk->next = runs, runs = blk, nruns++; }
+  }
+  for (blk = sortblocks(runs, nruns); blk; blk = next) {
+    next = blk->next;
+    n = blk->cls & ~RUN;
+    for (i = BYTESCLASSES - 1; n; i--) {
+      if (n & sizeof(fe_Object) << i) {
+        pushbytes(ctx, blk, i);
+        blk = (FreeBlock*) ((char*) blk + (sizeof(fe_Object) << i));
+        n -= sizeof(fe_Object) << i;
+      }
+    }
+  }
 }
 
-int fe_tostring(fe_Context *ctx, fe_Object *obj, char *dst, int size) {
-  CharPtrInt x;
-  x.p = dst;
-  x.n = size - 1;
-  fe_write(ctx, obj, writebuf, &x, 0);
-  *x.p = '\0';
-  return size - x.n - 1;
+
+static int makehole(fe_Context *ctx, int cls, size_t size) {
+  /* lends the lowest run of free objects large enough for a block of
+  ** `size` bytes, or gives a run at the top of an arena's objects back to
+  ** the unused space if that then has room for the block. Only called
+  ** between cycles, when every free object is on the freelist */
+  fe_Object **p;
+  Arena *a;
+  int i, start = 0, end, n = size / sizeof(fe_Object);
+  for (a = ctx->arenas; a; a = a->next) {
+    for (start = i = 0; i < a->object_count; i++) {
+      if (ishole(a, i) || type(&a->objects[i]) != FE_TFREE) { start = i + 1; }
+      else if (i + 1 - start == n) { break; }
+    }
+    if (i < a->object_count) { end = start + n; break; }
+    if ((a->object_count - start) * sizeof(fe_Object) + unused_space(a) >= size) {
+      end = a->object_count;
+      break;
+    }
+  }
+  if (!a) { return 0; }
+  /* take the run's objects off the freelist before the block overwrites
+  ** their links */
+  for (p = &ctx->freelist; !isnil(*p);) {
+    if (*p >= a->objects + start && *p < a->objects + end) {
+      *p = cdr(*p);
+    } else {
+      p = &cdr(*p);
+    }
+  }
+  if (end == a->object_count) {
+    a->object_count = start;
+  } else {
+    sethole(a, start, n, 1);
+    pushbytes(ctx, &a->objects[start], cls);
+  }
+  return 1;
 }
 
 
-fe_Number fe_tonumber(fe_Context *ctx, fe_Object *obj) {
-  return number(checktype(ctx, obj, FE_TNUMBER));
+static void fillholes(fe_Context *ctx) {
+  /* gives the objects of every free hole back to the freelist; only called
+  ** between cycles */
+  FreeBlock **p, *blk;
+  fe_Object *obj;
+  Arena *a;
+  int i, j, n = 0;
+  for (a = ctx->arenas; a; a = a->next) { n += a->holecount; }
+  for (i = 0; n && i < BYTESCLASSES; i++) {
+    for (p = &ctx->bytesfree[i]; (blk = *p);) {
+      a = arenaat(ctx, blk);
+      if ((char*) blk >= a->bytestop) {
+        p = &blk->next;
+        continue;
+      }
+      *p = blk->next;
+      obj = (fe_Object*) blk;
+      j = 1 << i;
+      sethole(a, obj - a->objects, j, 0);
+      while (j--) {
+        settype(&obj[j], FE_TFREE);
+        cdr(&obj[j]) = ctx->freelist;
+        ctx->freelist = &obj[j];
+      }
+    }
+    if (!ctx->bytesfree[i]) { ctx->bytesmask &= ~(1UL << i); }
+  }
 }
 
 
-void* fe_toptr(fe_Context *ctx, fe_Object *obj) {
-  return cdr(checktype(ctx, obj, FE_TPTR));
+static void startgc(fe_Context *ctx) {
+  /* shade the roots; the symbol table is shaded a bucket at a time */
+  Arena *a;
+  int i;
+  ctx->gcstate = GC_MARK;
+  ctx->gccycles++;
+  if (ctx->handlers.cycle) { ctx->handlers.cycle(ctx, 0); }
+  ctx->ngray = ctx->gcsym = ctx->grayoverflow = ctx->gclive = 0;
+  for (a = ctx->arenas; a; a = a->next) { a->gctop = 0; }
+  for (i = 0; i < ctx->gcstack_idx; i++) {
+    shade(ctx, ctx->gcstack[i]);
+  }
+  for (i = 0; i < ctx->profcount; i++) {
+    shade(ctx, ctx->prof[i].key);
+  }
+  if (ctx->vm) {
+    VM *vm = bytes(ctx->vm);
+    shade(ctx, ctx->vm);
+    for (i = 0; i < vm->sp; i++) { shade(ctx, vm->stack[i]); }
+  }
 }
 
 
-static fe_Object* getbound(fe_Object *sym, fe_Object *env) {
-  /* try to find in environment */
-  for (; !isnil(env); env = cdr(env)) {
-    fe_Object *x = car(env);
-    if (car(x) == sym) { return x; }
+static void rescan(fe_Context *ctx) {
+  Arena *a = ctx->gcarena;
+  if (!a) {
+    ctx->grayoverflow = 0;
+  } else if (a->gcscan == a->object_count) {
+    ctx->gcarena = a->next;
+    if (a->next) { a->next->gcscan = 0; }
+  } else if (ismarked(a, a->gcscan)) {
+    scan(ctx, &a->objects[a->gcscan++]);
+  } else {
+    a->gcscan++;
   }
-  /* return global */
-  return cdr(sym);
 }
 
 
-void fe_set(fe_Context *ctx, fe_Object *sym, fe_Object *v) {
-  unused(ctx);
-  cdr(getbound(sym, &nil)) = v;
+/* Sweeping is lazy: when the freelist runs dry object() sweeps the next word
+** of the bitmap, working up from the bottom of each arena. Everything above
+** an arena's last live object is dead, so that part is instead swept a word
+** at a time from the top down, returning the objects to the unused space */
+
+static void freeobj(fe_Context *ctx, fe_Object *obj) {
+  if (type(obj) == FE_TPTR && ctx->handlers.gc) {
+    ctx->handlers.gc(ctx, obj);
+  }
+  switch (type(obj)) {
+    case FE_TSTRING: case FE_TVECTOR: case FE_TTABLE: case FE_TARRAY:
+    case FE_TCOROUTINE: case T_CODE: case T_BYTES:
+      if (bytes(obj)) { freebytes(ctx, bytes(obj)); }
+      break;
+  }
+  settype(obj, FE_TFREE);
 }
 
 
-static fe_Object rparen;
+static void sweepdone(fe_Context *ctx) {
+  while (ctx->gcarena && ctx->gcarena->gcscan >= ctx->gcarena->gctop) {
+    ctx->gcarena = ctx->gcarena->next;
+  }
+  if (!ctx->gcarena && !ctx->gctails) {
+    ctx->gcstate = GC_IDLE;
+    mergebytes(ctx);
+    release(ctx);
+    if (ctx->handlers.cycle) { ctx->handlers.cycle(ctx, 1); }
+  }
+}
 
-static fe_Object* read_(fe_Context *ctx, fe_ReadFn fn, void *udata) {
-  const char *delimiter = " \n\t\r();";
-  fe_Object *v, *res, **tail;
-  fe_Number n;
-  int chr, gc;
-  char buf[64], *p;
 
-  /* get next character */
-  chr = ctx->nextchr ? ctx->nextchr : fn(ctx, udata);
-  ctx->nextchr = '\0';
+static void sweepword(fe_Context *ctx) {
+  Arena *a = ctx->gcarena;
+  int i = a->gcscan, n = i + MARKBITS;
+  unsigned long live = a->marks[i / MARKBITS] | a->holes[i / MARKBITS];
+  a->marks[i / MARKBITS] = 0;
+  a->gcscan = n;
+  /* push dead objects highest first so the lowest is handed out first;
+  ** holes are kept as if live */
+  if (~live) {
+    for (n = n < a->gctop ? n : a->gctop; n-- > i;) {
+      if (!(live >> (n % MARKBITS) & 1)) {
+        fe_Object *obj = &a->objects[n];
+        freeobj(ctx, obj);
+        cdr(obj) = ctx->freelist;
+        ctx->freelist = obj;
+      }
+    }
+  }
+  sweepdone(ctx);
+}
 
-  /* skip whitespace */
-  while (chr && strchr(" \n\t\r", chr)) {
-    chr = fn(ctx, udata);
+
+static void sweeptail(fe_Context *ctx) {
+  Arena *a = ctx->arenas;
+  fe_Object *obj;
+  int n;
+  while (a->gctail <= a->gctop) { a = a->next; }
+  n = a->gctail - MARKBITS;
+  for (n = n > a->gctop ? n : a->gctop; a->gctail > n;) {
+    obj = &a->objects[--a->gctail];
+    freeobj(ctx, obj);
+    /* objects may have been allocated above the tail since it was marked */
+    if (a->gctail == a->object_count - 1) {
+      a->object_count--;
+    } else {
+      cdr(obj) = ctx->freelist;
+      ctx->freelist = obj;
+    }
   }
+  if (a->gctail == a->gctop) { ctx->gctails--; }
+  sweepdone(ctx);
+}
 
-  switch (chr) {
-    case '\0':
-      return NULL;
 
-    case ';':
-      while (chr && chr != '\n') { chr = fn(ctx, udata); }
-      return read_(ctx, fn, udata);
+static int holetop(Arena *a, int top) {
+  /* the tail swept from the top down must not reach a hole */
+  int i = a->object_count / MARKBITS + 1;
+  if (!a->holecount) { return top; }
+  while (i-- > top / MARKBITS && !a->holes[i]);
+  return (i + 1) * MARKBITS > top ? (i + 1) * MARKBITS : top;
+}
 
-    case ')':
-      return &rparen;
 
-    case '(':
-      res = &nil;
-      tail = &res;
-      gc = fe_savegc(ctx);
-      fe_pushgc(ctx, res); /* to cause error on too-deep nesting */
-      while ( (v = read_(ctx, fn, udata)) != &rparen ) {
-        if (v == NULL) { fe_error(ctx, "unclosed list"); }
+static void endmark(fe_Context *ctx) {
+  /* the old freelist's objects are unmarked and will be found again by the
+  ** sweep */
+  Arena *a;
+  ctx->gcstate = GC_SWEEP;
+  ctx->freelist = &nil;
+  ctx->gctails = 0;
+  for (a = ctx->arenas; a; a = a->next) {
+    a->gcscan = 0;
+    a->gctail = a->object_count;
+    a->gctop = holetop(a, a->gctop);
+    a->gctop = (a->gctop + MARKBITS - 1) / MARKBITS * MARKBITS;
+    if (a->gctop > a->gctail) { a->gctop = a->gctail; }
+    if (a->gctail > a->gctop) { ctx->gctails++; }
+  }
+  ctx->gcarena = ctx->arenas;
+  ctx->gcmarked = ctx->gclive;
+  if (ctx->gclive > ctx->gcpeak) { ctx->gcpeak = ctx->gclive; }
+  /* if more than half the heap is live grow it rather than collect again
+  ** soon. Marking the live objects takes about one unit of work each;
+  ** start the next cycle early enough that it should finish, with room to
+  ** spare, before the free objects run out */
+  if (ctx->gclive > capacity(ctx) / 2) { grow(ctx, 0); }
+  ctx->gcwait = capacity(ctx) - ctx->gclive -
+                (ctx->gclive + ctx->symtab_size) * 2 / GCSTEPWORK;
+  sweepdone(ctx);
+}
+
+
+static void gcstep(fe_Context *ctx, int work) {
+  while (work > 0) {
+    ctx->gcwork++;
+    switch (ctx->gcstate) {
+      case GC_IDLE:
+        return;
+
+      case GC_MARK:
+        work--;
+        if (ctx->ngray > 0) {
+          scan(ctx, ctx->gray[--ctx->ngray]);
+        } else if (ctx->gcsym < ctx->symtab_size) {
+          shade(ctx, ctx->symtab[ctx->gcsym++]);
+        } else if (ctx->grayoverflow) {
+          rescan(ctx);
+        } else {
+          endmark(ctx);
+          return;
+        }
+        break;
+
+      case GC_SWEEP:
+        work--;
+        if (ctx->gctails) { sweeptail(ctx); }
+        else { sweepword(ctx); }
+        break;
+    }
+  }
+}
+
+
+static void finishgc(fe_Context *ctx) {
+  while (ctx->gcstate != GC_IDLE) { gcstep(ctx, GCSTEPWORK); }
+}
+
+
+static void collectgarbage(fe_Context *ctx) {
+  /* finish the cycle in progress then run a whole new one */
+  finishgc(ctx);
+  startgc(ctx);
+  finishgc(ctx);
+}
+
+
+void fe_stats(fe_Context *ctx, fe_Stats *st) {
+  st->allocs = ctx->gcallocs;
+  st->cycles = ctx->gccycles;
+  st->gcwork = ctx->gcwork;
+  st->stalls = ctx->gcstalls;
+  st->objects = capacity(ctx);
+  st->live = ctx->gcmarked;
+  st->live_max = ctx->gcpeak;
+  st->gcstack = ctx->gcstack_idx;
+  st->gcstack_max = ctx->gcstack_max;
+  st->calldepth = ctx->calldepth;
+  st->calldepth_max = ctx->calldepth_max;
+}
+
+
+static int equal(fe_Object *a, fe_Object *b) {
+  if (a == b) { return 1; }
+  if (type(a) != type(b)) { return 0; }
+  if (type(a) == FE_TNUMBER) { return number(a) == number(b); }
+  if (type(a) == FE_TSTRING) {
+    return length(a) == length(b) &&
+           !memcmp(strchars(a), strchars(b), length(a));
+  }
+  return 0;
+}
+
+
+static int streq(fe_Object *obj, const char *str) {
+  size_t n = strlen(str);
+  return n == (size_t) length(obj) && !memcmp(strchars(obj), str, n);
+}
+
+
+static Arena* bumparena(fe_Context *ctx, size_t size) {
+  Arena *a;
+  for (a = ctx->arenas; a; a = a->next) {
+    if (unused_space(a) >= size) { return a; }
+  }
+  return NULL;
+}
+
+
+static int hasfree(fe_Context *ctx) {
+  return !isnil(ctx->freelist) || bumparena(ctx, sizeof(fe_Object));
+}
+
+
+static fe_Object* object(fe_Context *ctx) {
+  fe_Object *obj;
+  Arena *a;
+  /* do a step of marking; sweep a word if an arena's dead top is left or
+  ** the next cycle is due, and start that cycle once the sweep is done */
+  switch (ctx->gcstate) {
+    case GC_MARK:
+      gcstep(ctx, GCSTEPWORK);
+      break;
+    case GC_SWEEP:
+      if (--ctx->gcwait < 0 || ctx->gctails) { gcstep(ctx, 1); }
+      break;
+    case GC_IDLE:
+      if (--ctx->gcwait < 0) { startgc(ctx); }
+      break;
+  }
+  /* sweep lazily until a free object turns up */
+  while (isnil(ctx->freelist) && ctx->gcstate == GC_SWEEP && ctx->gcarena) {
+    sweepword(ctx);
+  }
+  /* if no objects are left finish the cycle and take back the free holes,
+  ** then grow the heap or try a full cycle */
+  if (!hasfree(ctx)) {
+    ctx->gcstalls++;
+    finishgc(ctx);
+    if (!hasfree(ctx)) { fillholes(ctx); }
+    if (!hasfree(ctx) && !grow(ctx, 0)) {
+      collectgarbage(ctx);
+      fillholes(ctx);
+    }
+    if (!hasfree(ctx)) { fe_error(ctx, "out of memory"); }
+  }
+  /* get object from freelist, or the unused space if it's empty */
+  if (isnil(ctx->freelist)) {
+    a = bumparena(ctx, sizeof(fe_Object));
+    obj = &a->objects[a->object_count++];
+  } else {
+    obj = ctx->freelist;
+    ctx->freelist = cdr(obj);
+  }
+  /* objects allocated while marking are born marked; push to the gcstack */
+  if (ctx->gcstate == GC_MARK) {
+    a = arenaof(ctx, obj);
+    setmark(ctx, a, obj - a->objects);
+  }
+  ctx->gcallocs++;
+  fe_pushgc(ctx, obj);
+  return obj;
+}
+
+
+/* Byte blocks are allocated downwards from the end of an arena with the
+** objects growing up to meet them. Each block is a power-of-two multiple of
+** an object's size, prefixed by its size class, and is owned by exactly one
+** object which frees it when collected */
+
+static void* bytesblock(fe_Context *ctx, int cls, size_t size) {
+  FreeBlock *blk = ctx->bytesfree[cls];
+  Arena *a;
+  int c;
+  if (blk) {
+    if (!(ctx->bytesfree[cls] = blk->next)) { ctx->bytesmask &= ~(1UL << cls); }
+    arenaat(ctx, blk)->blocks++;
+    return blk;
+  }
+  /* split a free block of a larger class, freeing the lower halves, rather
+  ** than take space the objects could use */
+  if (ctx->bytesmask >> cls) {
+    for (c = cls + 1; !ctx->bytesfree[c]; c++);
+    blk = ctx->bytesfree[c];
+    if (!(ctx->bytesfree[c] = blk->next)) { ctx->bytesmask &= ~(1UL << c); }
+    while (c-- > cls) {
+      pushbytes(ctx, blk, c);
+      blk = (FreeBlock*) ((char*) blk + (sizeof(fe_Object) << c));
+    }
+    arenaat(ctx, blk)->blocks++;
+    return blk;
+  }
+  a = bumparena(ctx, size);
+  if (!a) { return NULL; }
+  a->bytestop -= size;
+  a->blocks++;
+  return a->bytestop;
+}
+
+
+static int bytesclass(size_t size, size_t *n) {
+  /* a block holds its class before the bytes asked for */
+  int cls = 0;
+  size += sizeof(size_t);
+  for (*n = sizeof(fe_Object); *n < size; *n <<= 1) { cls++; }
+  return cls;
+}
+
+
+static void* allocbytes(fe_Context *ctx, size_t size) {
+  size_t *blk, n;
+  int cls = bytesclass(size, &n);
+  blk = bytesblock(ctx, cls, n);
+  if (!blk) {
+    /* finishing a cycle joins the free blocks, else join them now */
+    ctx->gcstalls++;
+    if (ctx->gcstate == GC_IDLE) { mergebytes(ctx); }
+    finishgc(ctx);
+    blk = bytesblock(ctx, cls, n);
+  }
+  /* then lend free objects, grow the heap, or try a full cycle */
+  if (!blk && makehole(ctx, cls, n)) {
+    blk = bytesblock(ctx, cls, n);
+  }
+  if (!blk && grow(ctx, n)) {
+    blk = bytesblock(ctx, cls, n);
+  }
+  if (!blk) {
+    collectgarbage(ctx);
+    blk = bytesblock(ctx, cls, n);
+    if (!blk && makehole(ctx, cls, n)) { blk = bytesblock(ctx, cls, n); }
+    if (!blk) { fe_error(ctx, "out of memory"); }
+  }
+  /* a block brings the next cycle closer as the objects it could be would */
+  ctx->gcwait -= n / sizeof(fe_Object);
+  *blk = cls;
+  return blk + 1;
+}
+
+
+static void* trybytes(fe_Context *ctx, size_t size) {
+  /* like allocbytes() but never collects or grows the heap */
+  size_t *blk, n;
+  int cls = bytesclass(size, &n);
+  blk = bytesblock(ctx, cls, n);
+  if (!blk) { return NULL; }
+  *blk = cls;
+  return blk + 1;
+}
+
+
+static void growgcstack(fe_Context *ctx) {
+  /* the last slot is only used once growing has failed; the limit bounds
+  ** how deeply evaluation can recurse in C */
+  int cap = ctx->gcstack_cap * 2;
+  fe_Object **stack;
+  if (ctx->gcstack_idx == ctx->gcstack_cap) {
+    ctx->gcstack_idx--;
+    fe_error(ctx, "gc stack overflow");
+  }
+  if (cap > GCSTACKMAX) { return; }
+  stack = allocbytes(ctx, cap * sizeof(fe_Object*));
+  memcpy(stack, ctx->gcstack, ctx->gcstack_idx * sizeof(fe_Object*));
+  if (ctx->gcstack != ctx->gcstackinit) { freebytes(ctx, ctx->gcstack); }
+  ctx->gcstack = stack;
+  ctx->gcstack_cap = cap;
+}
+
+
+static int growgray(fe_Context *ctx) {
+  /* called while marking, so takes only free memory, and no more than a
+  ** 32nd of the heap; the grown stack is kept for later cycles */
+  int cap = ctx->graycap * 2;
+  fe_Object **stack;
+  if (cap * sizeof(fe_Object*) > capacity(ctx) * sizeof(fe_Object) / 32) {
+    return 0;
+  }
+  stack = trybytes(ctx, cap * sizeof(fe_Object*));
+  if (!stack) { return 0; }
+  memcpy(stack, ctx->gray, ctx->ngray * sizeof(fe_Object*));
+  if (ctx->gray != ctx->grayinit) { freebytes(ctx, ctx->gray); }
+  ctx->gray = stack;
+  ctx->graycap = cap;
+  return 1;
+}
+
+
+fe_Object* fe_cons(fe_Context *ctx, fe_Object *car, fe_Object *cdr) {
+  fe_Object *obj = object(ctx);
+  car(obj) = car;
+  cdr(obj) = cdr;
+  return obj;
+}
+
+
+fe_Object* fe_bool(fe_Context *ctx, int b) {
+  return b ? ctx->t : &nil;
+}
+
+
+fe_Object* fe_number(fe_Context *ctx, fe_Number n) {
+  fe_Object *obj;
+  if (IMMNUMBERS) { return immobject(n); }
+  obj = object(ctx);
+  settype(obj, FE_TNUMBER);
+  obj->cdr.n = n;
+  return obj;
+}
+
+
+/* A string's characters are kept in a byte block, followed by a null
+** terminator as a convenience for C; its length is kept in the bytes of the
+** car not used by the type, so strings are binary safe */
+
+static fe_Object* buildstring(fe_Context *ctx, const char *str, size_t len) {
+  fe_Object *obj = object(ctx);
+  settype(obj, FE_TSTRING);
+  bytes(obj) = NULL;
+  setlength(ctx, obj, len);
+  bytes(obj) = allocbytes(ctx, len + 1);
+  memcpy(strchars(obj), str, len);
+  strchars(obj)[len] = '\0';
+  return obj;
+}
+
+
+static void appendstring(fe_Context *ctx, fe_Object *obj, const char *str, size_t n) {
+  /* a full block is swapped for one of the next size up, so appending is
+  ** amortized O(1) */
+  size_t len = length(obj);
+  if (len + n + 1 > bytessize(bytes(obj))) {
+    void *p = allocbytes(ctx, len + n + 1);
+    memcpy(p, bytes(obj), len);
+    freebytes(ctx, bytes(obj));
+    bytes(obj) = p;
+  }
+  setlength(ctx, obj, len + n);
+  memcpy(strchars(obj) + len, str, n);
+  strchars(obj)[len + n] = '\0';
+}
+
+
+static void appendchar(fe_Context *ctx, fe_Object *obj, int chr) {
+  char c = chr;
+  appendstring(ctx, obj, &c, 1);
+}
+
+
+fe_Object* fe_string(fe_Context *ctx, const char *str) {
+  return buildstring(ctx, str, strlen(str));
+}
+
+
+static unsigned hashstr(const char *str, size_t len) {
+  unsigned h = 2166136261u;
+  while (len--) { h = (h ^ (unsigned char) *str++) * 16777619u; }
+  return h;
+}
+
+
+static void rehash(fe_Context *ctx) {
+  /* doubles the symbol table of a heap which can grow once it averages
+  ** more than two symbols a bucket, moving the buckets' pairs over; a fixed
+  ** heap's table is sized for it from the start. Put off while marking, as
+  ** the buckets are shaded in order, or until there is a free block */
+  fe_Object **tab, *lst, *next, *str;
+  int i, h, size = ctx->symtab_size * 2;
+  if (!ctx->alloc || ctx->symcount <= size || ctx->gcstate == GC_MARK) {
+    return;
+  }
+  tab = trybytes(ctx, size * sizeof(fe_Object*));
+  if (!tab) { return; }
+  for (i = 0; i < size; i++) { tab[i] = &nil; }
+  for (i = 0; i < ctx->symtab_size; i++) {
+    for (lst = ctx->symtab[i]; !isnil(lst); lst = next) {
+      next = cdr(lst);
+      str = car(cdr(car(lst)));
+      h = hashstr(strchars(str), length(str)) & (size - 1);
+      cdr(lst) = tab[h];
+      tab[h] = lst;
+    }
+  }
+  /* the first table is in the context's region, after the context */
+  if (ctx->symtab != (fe_Object**) (ctx + 1)) { freebytes(ctx, ctx->symtab); }
+  ctx->symtab = tab;
+  ctx->symtab_size = size;
+}
+
+
+static fe_Object* symbol(fe_Context *ctx, const char *name, size_t len) {
+  fe_Object *obj, *str, **bucket;
+  /* try to find in the symbol's bucket */
+  bucket = &ctx->symtab[hashstr(name, len) & (ctx->symtab_size - 1)];
+  for (obj = *bucket; !isnil(obj); obj = cdr(obj)) {
+    str = car(cdr(car(obj)));
+    if ((size_t) length(str) == len && !memcmp(strchars(str), name, len)) {
+      return car(obj);
+    }
+  }
+  /* create new object, push to bucket and return */
+  obj = object(ctx);
+  settype(obj, FE_TSYMBOL);
+  symlocal(obj) = 0;
+  cdr(obj) = fe_cons(ctx, buildstring(ctx, name, len), &nil);
+  store(ctx, bucket, fe_cons(ctx, obj, *bucket));
+  ctx->symcount++;
+  rehash(ctx);
+  return obj;
+}
+
+
+fe_Object* fe_symbol(fe_Context *ctx, const char *name) {
+  return symbol(ctx, name, strlen(name));
+}
+
+
+fe_Object* fe_cfunc(fe_Context *ctx, fe_CFunc fn) {
+  fe_Object *obj = object(ctx);
+  settype(obj, FE_TCFUNC);
+  isargv(obj) = 0;
+  cfunc(obj) = fn;
+  return obj;
+}
+
+
+fe_Object* fe_cfuncv(fe_Context *ctx, fe_CFuncV fn) {
+  fe_Object *obj = object(ctx);
+  settype(obj, FE_TCFUNC);
+  isargv(obj) = 1;
+  cfuncv(obj) = fn;
+  return obj;
+}
+
+
+fe_Object* fe_ptr(fe_Context *ctx, void *ptr) {
+  fe_Object *obj = object(ctx);
+  settype(obj, FE_TPTR);
+  cdr(obj) = ptr;
+  return obj;
+}
+
+
+fe_Object* fe_list(fe_Context *ctx, fe_Object **objs, int n) {
+  fe_Object *res = &nil;
+  while (n--) {
+    res = fe_cons(ctx, objs[n], res);
+  }
+  return res;
+}
+
+
+/* A vector's elements are kept in a byte block and its length in the car,
+** as with a string */
+
+static fe_Object* makevector(fe_Context *ctx, size_t n, fe_Object *fill) {
+  fe_Object *obj = object(ctx);
+  size_t i;
+  settype(obj, FE_TVECTOR);
+  bytes(obj) = NULL;
+  setlength(ctx, obj, n);
+  bytes(obj) = allocbytes(ctx, n * sizeof(fe_Object*));
+  for (i = 0; i < n; i++) { vecitems(obj)[i] = fill; }
+  return obj;
+}
+
+
+fe_Object* fe_vector(fe_Context *ctx, fe_Object **objs, int n) {
+  fe_Object *obj = makevector(ctx, n, &nil);
+  if (n > 0) { memcpy(vecitems(obj), objs, n * sizeof(fe_Object*)); }
+  return obj;
+}
+
+
+static fe_Object* listtovector(fe_Context *ctx, fe_Object *lst) {
+  fe_Object *obj, *p;
+  int n = 0;
+  for (p = lst; !isnil(p); p = cdr(checktype(ctx, p, FE_TPAIR))) { n++; }
+  obj = makevector(ctx, n, &nil);
+  for (n = 0; !isnil(lst); lst = cdr(lst)) { vecitems(obj)[n++] = car(lst); }
+  return obj;
+}
+
+
+static fe_Object* vectortolist(fe_Context *ctx, fe_Object *obj) {
+  checktype(ctx, obj, FE_TVECTOR);
+  return fe_list(ctx, vecitems(obj), length(obj));
+}
+
+
+static fe_Object* newvector(fe_Context *ctx, fe_Object *len, fe_Object *fill) {
+  fe_Number n = fe_tonumber(ctx, len);
+  if (!(n >= 0 && n <= 0x7fffffff)) { fe_error(ctx, "bad vector length"); }
+  return makevector(ctx, (size_t) n, fill);
+}
+
+
+static fe_Object** vecslot(fe_Context *ctx, fe_Object *obj, double idx) {
+  checktype(ctx, obj, FE_TVECTOR);
+  if (!(idx >= 0 && idx < length(obj))) {
+    fe_error(ctx, "vector index out of range");
+  }
+  return &vecitems(obj)[(int) idx];
+}
+
+
+int fe_veclen(fe_Context *ctx, fe_Object *obj) {
+  return length(checktype(ctx, obj, FE_TVECTOR));
+}
+
+
+fe_Object* fe_vecget(fe_Context *ctx, fe_Object *obj, int idx) {
+  return *vecslot(ctx, obj, idx);
+}
+
+
+void fe_vecset(fe_Context *ctx, fe_Object *obj, int idx, fe_Object *v) {
+  store(ctx, vecslot(ctx, obj, idx), v);
+}
+
+
+/* A table is a hash table with open addressing and linear probing: the cdr
+** points to a byte block of entries and the number of entries is kept in the
+** car. Keys are found with equal(), so numbers and strings are hashed by
+** value and everything else by address. An object never moves, and its
+** offset in the region stays the same when an image is loaded elsewhere, so
+** the offset is hashed rather than the address itself */
+
+static unsigned hashobj(fe_Context *ctx, fe_Object *obj) {
+  fe_Number n;
+  switch (type(obj)) {
+    case FE_TNIL:
+      return 0;
+    case FE_TNUMBER:
+      n = number(obj);
+      if (n == 0) { n = 0; } /* -0 equals 0 */
+      return hashstr((char*) &n, sizeof(n));
+    case FE_TSTRING:
+      return hashstr(strchars(obj), length(obj));
+  }
+  return (unsigned) (((char*) obj - (char*) ctx) / sizeof(fe_Object)) * 2654435761u;
+}
+
+
+static Entry* tabfind(fe_Context *ctx, fe_Object *tab, fe_Object *key) {
+  /* returns the key's entry, or the empty one it would be put in */
+  Entry *e = tabentries(tab);
+  int cap = tabcap(tab), i = hashobj(ctx, key) % cap;
+  while (e[i].key && !equal(e[i].key, key)) {
+    if (++i == cap) { i = 0; }
+  }
+  return &e[i];
+}
+
+
+static void tabresize(fe_Context *ctx, fe_Object *tab, size_t size) {
+  Entry *old = bytes(tab);
+  int i, cap = old ? tabcap(tab) : 0;
+  void *p = allocbytes(ctx, size);
+  memset(p, 0, bytessize(p));
+  bytes(tab) = p;
+  for (i = 0; i < cap; i++) {
+    if (old[i].key) { *tabfind(ctx, tab, old[i].key) = old[i]; }
+  }
+  if (old) { freebytes(ctx, old); }
+}
+
+
+fe_Object* fe_table(fe_Context *ctx) {
+  fe_Object *obj = object(ctx);
+  settype(obj, FE_TTABLE);
+  bytes(obj) = NULL;
+  setlength(ctx, obj, 0);
+  tabresize(ctx, obj, 4 * sizeof(Entry));
+  return obj;
+}
+
+
+int fe_tablen(fe_Context *ctx, fe_Object *obj) {
+  return length(checktype(ctx, obj, FE_TTABLE));
+}
+
+
+fe_Object* fe_tabget(fe_Context *ctx, fe_Object *obj, fe_Object *key) {
+  Entry *e = tabfind(ctx, checktype(ctx, obj, FE_TTABLE), key);
+  return e->key ? e->val : NULL;
+}
+
+
+void fe_tabset(fe_Context *ctx, fe_Object *obj, fe_Object *key, fe_Object *v) {
+  Entry *e = tabfind(ctx, checktype(ctx, obj, FE_TTABLE), key);
+  if (e->key) {
+    store(ctx, &e->val, v);
+    return;
+  }
+  /* keep the table at most 3/4 full so that runs stay short */
+  if ((length(obj) + 1) * 4 > tabcap(obj) * 3) {
+    tabresize(ctx, obj, bytessize(bytes(obj)) * 2);
+    e = tabfind(ctx, obj, key);
+  }
+  e->key = key;
+  e->val = v;
+  setlength(ctx, obj, length(obj) + 1);
+}
+
+
+void fe_tabdel(fe_Context *ctx, fe_Object *obj, fe_Object *key) {
+  Entry *e = tabfind(ctx, checktype(ctx, obj, FE_TTABLE), key), *base;
+  int i, j, k, cap = tabcap(obj);
+  if (!e->key) { return; }
+  fe_mark(ctx, e->key);
+  fe_mark(ctx, e->val);
+  setlength(ctx, obj, length(obj) - 1);
+  /* move back each later entry of the run which could no longer be found
+  ** past the emptied one */
+  base = tabentries(obj);
+  for (i = j = e - base;;) {
+    base[i].key = base[i].val = NULL;
+    do {
+      if (++j == cap) { j = 0; }
+      if (!base[j].key) { return; }
+      k = hashobj(ctx, base[j].key) % cap;
+    } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+    base[i] = base[j];
+    i = j;
+  }
+}
+
+
+int fe_tabnext(fe_Context *ctx, fe_Object *obj, int *iter, fe_Object **key, fe_Object **v) {
+  Entry *e = tabentries(checktype(ctx, obj, FE_TTABLE));
+  for (; *iter < tabcap(obj); (*iter)++) {
+    if (e[*iter].key) {
+      *key = e[*iter].key;
+      *v = e[(*iter)++].val;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+static fe_Object* tabkeys(fe_Context *ctx, fe_Object *obj) {
+  fe_Object *res = &nil, *key, *v;
+  int iter = 0, gc = fe_savegc(ctx);
+  while (fe_tabnext(ctx, obj, &iter, &key, &v)) {
+    res = fe_cons(ctx, key, res);
+    fe_restoregc(ctx, gc);
+    fe_pushgc(ctx, res);
+  }
+  return res;
+}
+
+
+/* An array packs numbers into a byte block, its length kept in the car as
+** with a vector. The bulk operations run over a whole array in C; where SSE
+** or AVX is available, and fe_Number is a float, they work on a register's
+** worth of numbers at a time, so build with -mavx for the widest kernels or
+** define FE_NOSIMD to keep to plain C */
+
+#if defined(__AVX__) && !defined(FE_NOSIMD)
+#define LANES         ( 8 )
+typedef __m256 Lanes;
+#define lload(p)      _mm256_loadu_ps((const float*) (p))
+#define lstore(p,x)   _mm256_storeu_ps((float*) (p), x)
+#define lset(n)       _mm256_set1_ps((float) (n))
+#define ladd          _mm256_add_ps
+#define lsub          _mm256_sub_ps
+#define lmul          _mm256_mul_ps
+#define ldiv          _mm256_div_ps
+#define lmin          _mm256_min_ps
+#define lmax          _mm256_max_ps
+#define land          _mm256_and_ps
+#define landnot       _mm256_andnot_ps
+#define lor           _mm256_or_ps
+#define lcmplt(a,b)   _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define lcmple(a,b)   _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define lcmpneq(a,b)  _mm256_cmp_ps(a, b, _CMP_NEQ_UQ)
+#elif defined(__SSE__) && !defined(FE_NOSIMD)
+#define LANES         ( 4 )
+typedef __m128 Lanes;
+#define lload(p)      _mm_loadu_ps((const float*) (p))
+#define lstore(p,x)   _mm_storeu_ps((float*) (p), x)
+#define lset(n)       _mm_set1_ps((float) (n))
+#define ladd          _mm_add_ps
+#define lsub          _mm_sub_ps
+#define lmul          _mm_mul_ps
+#define ldiv          _mm_div_ps
+#define lmin          _mm_min_ps
+#define lmax          _mm_max_ps
+#define land          _mm_and_ps
+#define landnot       _mm_andnot_ps
+#define lor           _mm_or_ps
+#define lcmplt        _mm_cmplt_ps
+#define lcmple        _mm_cmple_ps
+#define lcmpneq       _mm_cmpneq_ps
+#endif
+
+/* an operand of an element-wise operation: an array's numbers, or a single
+** number used for every element */
+typedef struct { const fe_Number *p; fe_Number n; } Operand;
+
+#define sget(o,i)     ( (o).p ? (o).p[i] : (o).n )
+
+#ifdef LANES
+#define lget(o,i)     ( (o).p ? lload((o).p + (i)) : lset((o).n) )
+#define lanes(stmt)                                     \
+  if (sizeof(fe_Number) == sizeof(float)) {             \
+    for (; i + LANES <= n; i += LANES) { stmt }         \
+  }
+#else
+#define lanes(stmt)
+#endif
+
+#define maploop(vexpr, sexpr)                           \
+  lanes(Lanes a = lget(o[0], i); Lanes b = lget(o[1], i); \
+        lstore(dst + i, vexpr);)                        \
+  for (; i < n; i++) {                                  \
+    fe_Number a = sget(o[0], i), b = sget(o[1], i);     \
+    dst[i] = sexpr;                                     \
+  }
+
+static void arrmap(int p, fe_Number *dst, Operand *o, int n) {
+  int i = 0;
+  switch (p) {
+    case P_ARRADD: maploop(ladd(a, b), a + b); break;
+    case P_ARRSUB: maploop(lsub(a, b), a - b); break;
+    case P_ARRMUL: maploop(lmul(a, b), a * b); break;
+    case P_ARRDIV: maploop(ldiv(a, b), a / b); break;
+    case P_ARRLT: maploop(land(lcmplt(a, b), lset(1)), a < b); break;
+    case P_ARRLTE: maploop(land(lcmple(a, b), lset(1)), a <= b); break;
+    case P_ARRSEL:
+      /* the first operand picks between the other two */
+      lanes(Lanes m = lcmpneq(lget(o[0], i), lset(0));
+            lstore(dst + i, lor(land(m, lget(o[1], i)), landnot(m, lget(o[2], i))));)
+      for (; i < n; i++) {
+        dst[i] = sget(o[0], i) != 0 ? sget(o[1], i) : sget(o[2], i);
+      }
+      break;
+  }
+}
+
+
+static fe_Number arrreduce(int p, const fe_Number *a, const fe_Number *b, int n) {
+  fe_Number r = (p == P_ARRMIN || p == P_ARRMAX) ? a[0] : 0;
+  int i = 0;
+#ifdef LANES
+  if (sizeof(fe_Number) == sizeof(float) && n > LANES) {
+    /* reduce into a register of partial results, then reduce those */
+    float t[LANES];
+    Lanes x = (p == P_ARRMIN || p == P_ARRMAX) ? lload(a) : lset(0);
+    switch (p) {
+      case P_ARRSUM: lanes(x = ladd(x, lload(a + i));) break;
+      case P_ARRMIN: lanes(x = lmin(x, lload(a + i));) break;
+      case P_ARRMAX: lanes(x = lmax(x, lload(a + i));) break;
+      case P_ARRDOT: lanes(x = ladd(x, lmul(lload(a + i), lload(b + i)));) break;
+    }
+    lstore(t, x);
+    r = arrreduce(p == P_ARRDOT ? P_ARRSUM : p, (fe_Number*) t, NULL, LANES);
+  }
+#endif
+  switch (p) {
+    case P_ARRSUM: for (; i < n; i++) { r += a[i]; } break;
+    case P_ARRMIN: for (; i < n; i++) { r = a[i] < r ? a[i] : r; } break;
+    case P_ARRMAX: for (; i < n; i++) { r = a[i] > r ? a[i] : r; } break;
+    case P_ARRDOT: for (; i < n; i++) { r += a[i] * b[i]; } break;
+  }
+  return r;
+}
+
+
+static fe_Object* makearray(fe_Context *ctx, size_t n, fe_Number fill) {
+  fe_Object *obj = object(ctx);
+  size_t i;
+  settype(obj, FE_TARRAY);
+  bytes(obj) = NULL;
+  setlength(ctx, obj, n);
+  bytes(obj) = allocbytes(ctx, n * sizeof(fe_Number));
+  for (i = 0; i < n; i++) { arritems(obj)[i] = fill; }
+  return obj;
+}
+
+
+fe_Object* fe_array(fe_Context *ctx, const fe_Number *data, int n) {
+  fe_Object *obj = makearray(ctx, n, 0);
+  if (n > 0) { memcpy(arritems(obj), data, n * sizeof(fe_Number)); }
+  return obj;
+}
+
+
+int fe_arrlen(fe_Context *ctx, fe_Object *obj) {
+  return length(checktype(ctx, obj, FE_TARRAY));
+}
+
+
+fe_Number* fe_arrdata(fe_Context *ctx, fe_Object *obj) {
+  return arritems(checktype(ctx, obj, FE_TARRAY));
+}
+
+
+static fe_Object* newarray(fe_Context *ctx, fe_Object *len, fe_Object *fill) {
+  fe_Number n = fe_tonumber(ctx, len);
+  if (!(n >= 0 && n <= 0x7fffffff)) { fe_error(ctx, "bad array length"); }
+  return makearray(ctx, (size_t) n, isnil(fill) ? 0 : fe_tonumber(ctx, fill));
+}
+
+
+static fe_Object* toarray(fe_Context *ctx, fe_Object *obj) {
+  fe_Object *res, *p;
+  int n = 0;
+  if (type(obj) == FE_TVECTOR) {
+    res = makearray(ctx, length(obj), 0);
+    for (; n < length(obj); n++) {
+      arritems(res)[n] = fe_tonumber(ctx, vecitems(obj)[n]);
+    }
+    return res;
+  }
+  for (p = obj; !isnil(p); p = cdr(checktype(ctx, p, FE_TPAIR))) { n++; }
+  res = makearray(ctx, n, 0);
+  for (n = 0; !isnil(obj); obj = cdr(obj)) {
+    arritems(res)[n++] = fe_tonumber(ctx, car(obj));
+  }
+  return res;
+}
+
+
+static fe_Object* tolist(fe_Context *ctx, fe_Object *obj) {
+  fe_Object *res = &nil;
+  int i, gc;
+  if (type(obj) != FE_TARRAY) { return vectortolist(ctx, obj); }
+  gc = fe_savegc(ctx);
+  for (i = length(obj); i--;) {
+    res = fe_cons(ctx, fe_number(ctx, arritems(obj)[i]), res);
+    fe_restoregc(ctx, gc);
+    fe_pushgc(ctx, res);
+  }
+  return res;
+}
+
+
+static fe_Number* arrslot(fe_Context *ctx, fe_Object *obj, double idx) {
+  checktype(ctx, obj, FE_TARRAY);
+  if (!(idx >= 0 && idx < length(obj))) {
+    fe_error(ctx, "array index out of range");
+  }
+  return &arritems(obj)[(int) idx];
+}
+
+
+static fe_Object* arrayop(fe_Context *ctx, int p, fe_Object **args) {
+  /* runs one of the bulk primitives, from arrfill on, on its arguments */
+  fe_Object *obj = checktype(ctx, args[0], FE_TARRAY);
+  fe_Number *dst = arritems(obj), x, step;
+  Operand o[3];
+  int i, n = length(obj);
+  switch (p) {
+    case P_ARRFILL:
+      x = fe_tonumber(ctx, args[1]);
+      for (i = 0; i < n; i++) { dst[i] = x; }
+      return obj;
+
+    case P_ARRSEQ:
+      x = fe_tonumber(ctx, args[1]);
+      step = fe_tonumber(ctx, args[2]);
+      for (i = 0; i < n; i++) { dst[i] = x + i * step; }
+      return obj;
+
+    case P_ARRSUM: case P_ARRMIN: case P_ARRMAX: case P_ARRDOT:
+      if (n == 0 && p != P_ARRSUM && p != P_ARRDOT) {
+        fe_error(ctx, "empty array");
+      }
+      if (p == P_ARRDOT && fe_arrlen(ctx, args[1]) != n) {
+        fe_error(ctx, "array lengths differ");
+      }
+      return fe_number(ctx, arrreduce(p, dst, p == P_ARRDOT ?
+                                      arritems(args[1]) : NULL, n));
+  }
+  /* element-wise: each operand is an array as long as the destination, or a
+  ** number */
+  for (i = 1; i < arrargs[p - P_ARRFILL]; i++) {
+    Operand *e = &o[i - 1];
+    if (type(args[i]) == FE_TARRAY) {
+      if (length(args[i]) != n) { fe_error(ctx, "array lengths differ"); }
+      e->p = arritems(args[i]);
+    } else {
+      e->p = NULL;
+      e->n = fe_tonumber(ctx, args[i]);
+    }
+  }
+  arrmap(p, dst, o, n);
+  return obj;
+}
+
+
+fe_Object* fe_car(fe_Context *ctx, fe_Object *obj) {
+  if (isnil(obj)) { return obj; }
+  return car(checktype(ctx, obj, FE_TPAIR));
+}
+
+
+fe_Object* fe_cdr(fe_Context *ctx, fe_Object *obj) {
+  if (isnil(obj)) { return obj; }
+  return cdr(checktype(ctx, obj, FE_TPAIR));
+}
+
+
+/* Output is gathered in a small buffer and passed on a block at a time; the
+** per-character fe_write() is a block writer which feeds its callback each
+** character of the block in turn */
+
+typedef struct {
+  fe_Context *ctx;
+  fe_WriteBlockFn fn;
+  void *udata;
+  int n;
+  char buf[256];
+} Sink;
+
+static void flush(Sink *s) {
+  if (s->n) { s->fn(s->ctx, s->udata, s->buf, s->n); }
+  s->n = 0;
+}
+
+static void put(Sink *s, const char *str, int len) {
+  while (s->n + len > (int) sizeof(s->buf)) {
+    int n = sizeof(s->buf) - s->n;
+    memcpy(s->buf + s->n, str, n);
+    s->n += n, str += n, len -= n;
+    flush(s);
+  }
+  memcpy(s->buf + s->n, str, len);
+  s->n += len;
+}
+
+static void putch(Sink *s, char chr) {
+  if (s->n == (int) sizeof(s->buf)) { flush(s); }
+  s->buf[s->n++] = chr;
+}
+
+
+static int fmtnumber(char *buf, fe_Number n) {
+  /* formats as sprintf("%.7g") would. Numbers printed without an exponent
+  ** are done directly: scaled to 7 digits the float's 24 bit mantissa times
+  ** a power of ten of at most 10^10 (whose odd part fits in 24 bits) is
+  ** exact in a double, so rounding it to an integer rounds as printf does.
+  ** Anything else, including a number which rounds up to the next power of
+  ** ten, or a number type other than float, is left to sprintf() */
+  static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10
+  };
+  double v = n < 0 ? -(double) n : n, m, f;
+  long digits;
+  int exp, i, len = 0;
+  char tmp[8];
+  if (sizeof(fe_Number) == sizeof(float) && v >= 1e-4 && v < 1e7) {
+    for (exp = 6; exp > -4 && v * pow10[6 - exp] < 1e6; exp--);
+    m = v * pow10[6 - exp];
+    digits = (long) m;
+    f = m - digits;
+    if (f > 0.5 || (f == 0.5 && (digits & 1))) { digits++; }
+    if (digits >= 1000000 && digits < 10000000) {
+      for (i = 7; i--; digits /= 10) { tmp[i] = '0' + digits % 10; }
+      if (n < 0) { buf[len++] = '-'; }
+      if (exp < 0) {
+        buf[len++] = '0';
+        buf[len++] = '.';
+        for (i = exp; ++i < 0;) { buf[len++] = '0'; }
+      }
+      for (i = 0; i < 7; i++) {
+        if (i == exp + 1 && exp >= 0) { buf[len++] = '.'; }
+        buf[len++] = tmp[i];
+      }
+      /* drop trailing zeros of the fraction, and the point if it's left */
+      if (exp < 6) {
+        while (buf[len - 1] == '0') { len--; }
+        if (buf[len - 1] == '.') { len--; }
+      }
+      buf[len] = '\0';
+      return len;
+    }
+  }
+  return sprintf(buf, "%.7g", n);
+}
+
+
+static void write_(Sink *s, fe_Object *obj, int qt) {
+  fe_Object *names;
+  char buf[32];
+  const char *p, *q;
+  int n;
+
+  switch (type(obj)) {
+    case FE_TNIL:
+      put(s, "nil", 3);
+      break;
+
+    case FE_TNUMBER:
+      put(s, buf, fmtnumber(buf, number(obj)));
+      break;
+
+    case FE_TPAIR:
+      putch(s, '(');
+      for (;;) {
+        write_(s, car(obj), 1);
+        obj = cdr(obj);
+        if (type(obj) != FE_TPAIR) { break; }
+        putch(s, ' ');
+      }
+      if (!isnil(obj)) {
+        put(s, " . ", 3);
+        write_(s, obj, 1);
+      }
+      putch(s, ')');
+      break;
+
+    case FE_TVECTOR:
+      put(s, "#(", 2);
+      for (n = 0; n < length(obj); n++) {
+        if (n > 0) { putch(s, ' '); }
+        write_(s, vecitems(obj)[n], 1);
+      }
+      putch(s, ')');
+      break;
+
+    case FE_TSYMBOL:
+      write_(s, car(cdr(obj)), 0);
+      break;
+
+    case T_LOCAL: case T_GLOBAL:
+      write_(s, cdr(obj), 0);
+      break;
+
+    case T_LAYOUT:
+      /* write the parameter list the layout was resolved from */
+      n = layparams(obj);
+      names = cdr(obj);
+      if (n == 0) {
+        write_(s, layrest(obj) ? car(names) : &nil, 0);
+        break;
+      }
+      putch(s, '(');
+      for (;;) {
+        write_(s, car(names), 0);
+        names = cdr(names);
+        if (--n == 0) { break; }
+        putch(s, ' ');
+      }
+      if (layrest(obj)) {
+        put(s, " . ", 3);
+        write_(s, car(names), 0);
+      }
+      putch(s, ')');
+      break;
+
+    case FE_TSTRING:
+      p = strchars(obj);
+      n = length(obj);
+      if (!qt) {
+        put(s, p, n);
+        break;
+      }
+      /* write the runs between quotes, escaping each quote */
+      putch(s, '"');
+      while ((q = memchr(p, '"', n))) {
+        put(s, p, q - p);
+        put(s, "\\\"", 2);
+        n -= q - p + 1;
+        p = q + 1;
+      }
+      put(s, p, n);
+      putch(s, '"');
+      break;
+
+    default:
+      sprintf(buf, "[%s %p]", typenames[type(obj)], (void*) obj);
+      put(s, buf, strlen(buf));
+      break;
+  }
+}
+
+
+void fe_writeblock(fe_Context *ctx, fe_Object *obj, fe_WriteBlockFn fn, void *udata, int qt) {
+  Sink s;
+  s.ctx = ctx;
+  s.fn = fn;
+  s.udata = udata;
+  s.n = 0;
+  write_(&s, obj, qt);
+  flush(&s);
+}
+
+
+typedef struct { fe_WriteFn fn; void *udata; } CharWriter;
+
+static void writechars(fe_Context *ctx, void *udata, const char *data, int len) {
+  CharWriter *w = udata;
+  while (len--) { w->fn(ctx, w->udata, *data++); }
+}
+
+void fe_write(fe_Context *ctx, fe_Object *obj, fe_WriteFn fn, void *udata, int qt) {
+  CharWriter w;
+  w.fn = fn;
+  w.udata = udata;
+  fe_writeblock(ctx, obj, writechars, &w, qt);
+}
+
+
+static void writefp(fe_Context *ctx, void *udata, const char *data, int len) {
+  unused(ctx);
+  fwrite(data, 1, len, udata);
+}
+
+void fe_writefp(fe_Context *ctx, fe_Object *obj, FILE *fp) {
+  fe_writeblock(ctx, obj, writefp, fp, 0);
+}
+
+
+typedef struct { char *p; int n; } CharPtrInt;
+
+static void writebuf(fe_Context *ctx, void *udata, const char *data, int len) {
+  CharPtrInt *x = udata;
+  unused(ctx);
+  if (len > x->n) { len = x->n; }
+  memcpy(x->p, data, len);
+  x->p += len;
+  x->n -= len;
+}
+
+int fe_tostring(fe_Context *ctx, fe_Object *obj, char *dst, int size) {
+  CharPtrInt x;
+  x.p = dst;
+  x.n = size - 1;
+  fe_writeblock(ctx, obj, writebuf, &x, 0);
+  *x.p = '\0';
+  return size - x.n - 1;
+}
+
+
+fe_Number fe_tonumber(fe_Context *ctx, fe_Object *obj) {
+  return number(checktype(ctx, obj, FE_TNUMBER));
+}
+
+
+void* fe_toptr(fe_Context *ctx, fe_Object *obj) {
+  return cdr(checktype(ctx, obj, FE_TPTR));
+}
+
+
+/* A symbol is flagged the first time anything binds it locally, by name
+** (LOCAL_NAME) or in a frame's layout (LOCAL_SLOT); until then it can only
+** refer to its global, so most names skip the walk of the environment, and
+** names never given a slot skip looking inside frames */
+
+static void bindlocal(fe_Object *sym, int how) {
+  if (type(sym) == FE_TSYMBOL) { symlocal(sym) |= how; }
+}
+
+
+static fe_Object** getbound(fe_Object *sym, fe_Object *env) {
+  if (!symlocal(sym)) { return &cdr(cdr(sym)); }
+  /* try to find in environment */
+  if (!(symlocal(sym) & LOCAL_SLOT)) {
+    for (; !isnil(env); env = cdr(env)) {
+      if (car(car(env)) == sym) { return &cdr(car(env)); }
+    }
+    return &cdr(cdr(sym));
+  }
+  for (; !isnil(env); env = cdr(env)) {
+    fe_Object *x = car(env);
+    if (car(x) == sym) { return &cdr(x); }
+    if (type(car(x)) == T_LAYOUT) {
+      /* frame: the layout's names run parallel to the frame's slots, the
+      ** last match is the innermost binding */
+      fe_Object *n = cdr(car(x)), *v = cdr(x), **res = NULL;
+      int i;
+      for (i = layslots(car(x)); i--; n = cdr(n), v = cdr(v)) {
+        if (car(n) == sym) { res = &car(v); }
+      }
+      if (res) { return res; }
+    }
+  }
+  /* return global */
+  return &cdr(cdr(sym));
+}
+
+
+static fe_Object* getnode(fe_Object *ref, fe_Object *env) {
+  int depth = refdepth(ref), slot = refslot(ref);
+  /* only frames count towards the depth; `let` bindings are skipped. A flat
+  ** closure's frame is followed by its cells, in an entry of the form
+  ** (captures . cells) */
+  for (;; env = cdr(env)) {
+    fe_Object *x = car(env);
+    if (type(car(x)) == T_CAPTURES) { env = cdr(x); break; }
+    if (type(car(x)) == T_LAYOUT && depth-- == 0) { env = cdr(x); break; }
+  }
+  for (; slot--; env = cdr(env));
+  return env;
+}
+
+
+static fe_Object** getslot(fe_Object *ref, fe_Object *env) {
+  fe_Object *node = getnode(ref, env);
+  switch (refcell(ref)) {
+    case CELL_CAR: return &car(car(node));
+    case CELL_CDR: return &cdr(car(node));
+    default: return &car(node);
+  }
+}
+
+
+static fe_Object** getvar(fe_Object *obj, fe_Object *env) {
+  switch (type(obj)) {
+    case T_LOCAL: return getslot(obj, env);
+    case T_GLOBAL: return &cdr(cdr(cdr(obj)));
+    default: return getbound(obj, env);
+  }
+}
+
+
+void fe_set(fe_Context *ctx, fe_Object *sym, fe_Object *v) {
+  store(ctx, getbound(sym, &nil), v);
+}
+
+
+/* The profiler keeps a tree of the calls made to fe functions and cfuncs,
+** one node per distinct call path, keyed by the function's body (or the
+** cfunc) so every closure made from one `fn` shares a node. Allocations and
+** any pending samples are credited to the current node whenever a call is
+** entered or left; as the current node only changes there this attributes
+** them exactly. A call made in tail position replaces its caller's node */
+
+static void profsync(fe_Context *ctx) {
+  ProfNode *n = &ctx->prof[ctx->profcur];
+  int ticks = ctx->proftick;
+  ctx->proftick -= ticks;
+  n->counts[FE_PSAMPLES] += ticks;
+  n->counts[FE_PALLOCS] += ctx->gcallocs - ctx->profallocs;
+  ctx->profallocs = ctx->gcallocs;
+}
+
+
+static fe_Object* profname(fe_Context *ctx, fe_Object *key) {
+  /* the name of a global bound to the function, if there is one */
+  fe_Object *lst, *v;
+  int i;
+  for (i = 0; i < ctx->symtab_size; i++) {
+    for (lst = ctx->symtab[i]; !isnil(lst); lst = cdr(lst)) {
+      v = cdr(cdr(car(lst)));
+      if (v == key || (type(v) == FE_TFUNC && cdr(cdr(v)) == key)) {
+        return car(lst);
+      }
+    }
+  }
+  return NULL;
+}
+
+
+static void profenter(fe_Context *ctx, int parent, fe_Object *key) {
+  ProfNode *n;
+  int i;
+  profsync(ctx);
+  for (i = ctx->prof[parent].child; i; i = ctx->prof[i].next) {
+    if (ctx->prof[i].key == key) { break; }
+  }
+  /* calls past a full buffer are credited to their caller */
+  if (!i) {
+    if (ctx->profcount == ctx->profcap) { ctx->profcur = parent; return; }
+    i = ctx->profcount++;
+    n = &ctx->prof[i];
+    memset(n, 0, sizeof(ProfNode));
+    n->key = key;
+    n->name = profname(ctx, key);
+    n->parent = parent;
+    n->next = ctx->prof[parent].child;
+    ctx->prof[parent].child = i;
+  }
+  ctx->prof[i].counts[FE_PCALLS]++;
+  ctx->profcur = i;
+}
+
+
+static void profleave(fe_Context *ctx, int node) {
+  profsync(ctx);
+  ctx->profcur = node;
+}
+
+
+static void callenter(fe_Context *ctx, int *caller, fe_Object *key) {
+  /* `*caller` is -1 until the call is entered, then the profiler node it was
+  ** entered from; a tail call enters again from the same node */
+  if (*caller < 0) {
+    *caller = ctx->profcur;
+    if (++ctx->calldepth > ctx->calldepth_max) {
+      ctx->calldepth_max = ctx->calldepth;
+    }
+  }
+  if (ctx->prof) { profenter(ctx, *caller, key); }
+}
+
+
+static void callleave(fe_Context *ctx, int caller) {
+  ctx->calldepth--;
+  if (ctx->prof) { profleave(ctx, caller); }
+}
+
+
+void fe_profile(fe_Context *ctx, void *ptr, int size) {
+  ctx->prof = NULL;
+  ctx->profcount = ctx->profcap = ctx->profcur = 0;
+  if (!ptr || size < (int) sizeof(ProfNode)) { return; }
+  ctx->prof = ptr;
+  ctx->profcap = size / sizeof(ProfNode);
+  ctx->profcount = 1;
+  memset(ctx->prof, 0, sizeof(ProfNode));
+  ctx->prof[0].parent = -1;
+  ctx->profallocs = ctx->gcallocs;
+  ctx->proftick = 0;
+}
+
+
+void fe_profiletick(fe_Context *ctx) {
+  ctx->proftick++;
+}
+
+
+static void writeframes(fe_Context *ctx, int i, FILE *fp) {
+  ProfNode *n = &ctx->prof[i];
+  if (n->parent > 0) {
+    writeframes(ctx, n->parent, fp);
+    fputc(';', fp);
+  }
+  if (n->name) {
+    fe_writefp(ctx, n->name, fp);
+  } else {
+    fputs(type(n->key) == FE_TCFUNC ? "(cfunc)" : "(fn)", fp);
+  }
+}
+
+
+void fe_writeprofile(fe_Context *ctx, FILE *fp, int what) {
+  /* one line per call path with a non-zero count: the path's functions,
+  ** outermost first and separated by `;`, then the count */
+  int i;
+  if (!ctx->prof) { return; }
+  profsync(ctx);
+  for (i = 0; i < ctx->profcount; i++) {
+    unsigned long n = ctx->prof[i].counts[what];
+    if (!n) { continue; }
+    if (i) { writeframes(ctx, i, fp); }
+    else { fputs("(toplevel)", fp); }
+    fprintf(fp, " %lu\n", n);
+  }
+}
+
+
+static fe_Object rparen;
+
+static fe_Object* read_(fe_Context *ctx, fe_ReadFn fn, void *udata) {
+  const char *delimiter = " \n\t\r();";
+  fe_Object *v, *res, **tail;
+  fe_Number n;
+  int chr, gc;
+  char buf[64], *p;
+
+  /* get next character */
+  chr = ctx->nextchr ? ctx->nextchr : fn(ctx, udata);
+  ctx->nextchr = '\0';
+
+  /* skip whitespace */
+  while (chr && strchr(" \n\t\r", chr)) {
+    chr = fn(ctx, udata);
+  }
+
+  switch (chr) {
+    case '\0':
+      return NULL;
+
+    case ';':
+      while (chr && chr != '\n') { chr = fn(ctx, udata); }
+      return read_(ctx, fn, udata);
+
+    case ')':
+      return &rparen;
+
+    case '(':
+      res = &nil;
+      tail = &res;
+      gc = fe_savegc(ctx);
+      fe_pushgc(ctx, res); /* to cause error on too-deep nesting */
+      while ( (v = read_(ctx, fn, udata)) != &rparen ) {
+        if (v == NULL) { fe_error(ctx, "unclosed list"); }
+        if (type(v) == FE_TSYMBOL && streq(car(cdr(v)), ".")) {
+          /* dotted pair */
+          *tail = fe_read(ctx, fn, udata);
+        } else {
+          /* proper pair */
+          *tail = fe_cons(ctx, v, &nil);
+          tail = &cdr(*tail);
+        }
+        fe_restoregc(ctx, gc);
+        fe_pushgc(ctx, res);
+      }
+      return res;
+
+    case '\'':
+      v = fe_read(ctx, fn, udata);
+      if (!v) { fe_error(ctx, "stray '''"); }
+      return fe_cons(ctx, fe_symbol(ctx, "quote"), fe_cons(ctx, v, &nil));
+
+    case '"':
+      res = buildstring(ctx, "", 0);
+      chr = fn(ctx, udata);
+      while (chr != '"') {
+        if (chr == '\0') { fe_error(ctx, "unclosed string"); }
+        if (chr == '\\') {
+          chr = fn(ctx, udata);
+          if (chr && strchr("nrt", chr)) { chr = strchr("n\nr\rt\t", chr)[1]; }
+        }
+        appendchar(ctx, res, chr);
+        chr = fn(ctx, udata);
+      }
+      return res;
+
+    default:
+      p = buf;
+      do {
+        if (p == buf + sizeof(buf) - 1) { fe_error(ctx, "symbol too long"); }
+        *p++ = chr;
+        chr = fn(ctx, udata);
+      } while (chr && !strchr(delimiter, chr));
+      *p = '\0';
+      ctx->nextchr = chr;
+      n = strtod(buf, &p);  /* try to read as number */
+      if (p != buf && strchr(delimiter, *p)) { return fe_number(ctx, n); }
+      if (!strcmp(buf, "nil")) { return &nil; }
+      if (!strcmp(buf, "#") && chr == '(') {
+        /* vector literal */
+        return listtovector(ctx, read_(ctx, fn, udata));
+      }
+      return fe_symbol(ctx, buf);
+  }
+}
+
+
+fe_Object* fe_read(fe_Context *ctx, fe_ReadFn fn, void *udata) {
+  fe_Object* obj = read_(ctx, fn, udata);
+  if (obj == &rparen) { fe_error(ctx, "stray ')'"); }
+  return obj;
+}
+
+
+static char readfp(fe_Context *ctx, void *udata) {
+  int chr;
+  unused(ctx);
+  return (chr = fgetc(udata)) == EOF ? '\0' : chr;
+}
+
+fe_Object* fe_readfp(fe_Context *ctx, FILE *fp) {
+  return fe_read(ctx, readfp, fp);
+}
+
+
+/* The buffer reader follows the same grammar as read_() but works directly
+** on the buffer: atoms are scanned in place and interned or copied straight
+** from it, and only atoms which may be numbers are handed to strtod() */
+
+static int isdelim(int chr) {
+  switch (chr) {
+    case ' ': case '\n': case '\t': case '\r': case '\0':
+    case '(': case ')': case ';':
+      return 1;
+  }
+  return 0;
+}
+
+
+static fe_Object* readbuf_(fe_Context *ctx, const char **data, const char *end) {
+  const char *p = *data, *start, *num, *q;
+  fe_Object *v, *res, **tail;
+  fe_Number n;
+  double d;
+  char buf[64], *e;
+  int chr, gc;
+
+  /* skip whitespace and comments */
+  for (;;) {
+    while (p < end && isdelim(*p) && *p != '(' && *p != ')' && *p != ';') {
+      p++;
+    }
+    if (p == end || *p != ';') { break; }
+    while (p < end && *p != '\n') { p++; }
+  }
+  if (p == end) {
+    *data = p;
+    return NULL;
+  }
+
+  switch (*p) {
+    case ')':
+      *data = p + 1;
+      return &rparen;
+
+    case '(':
+      *data = p + 1;
+      res = &nil;
+      tail = &res;
+      gc = fe_savegc(ctx);
+      fe_pushgc(ctx, res); /* to cause error on too-deep nesting */
+      while ( (v = readbuf_(ctx, data, end)) != &rparen ) {
+        if (v == NULL) { fe_error(ctx, "unclosed list"); }
         if (type(v) == FE_TSYMBOL && streq(car(cdr(v)), ".")) {
           /* dotted pair */
-          *tail = fe_read(ctx, fn, udata);
+          *tail = readbuf_(ctx, data, end);
+          if (*tail == &rparen) { fe_error(ctx, "stray ')'"); }
+        } else {
+          /* proper pair */
+          *tail = fe_cons(ctx, v, &nil);
+          tail = &cdr(*tail);
+        }
+        fe_restoregc(ctx, gc);
+        fe_pushgc(ctx, res);
+      }
+      return res;
+
+    case '\'':
+      *data = p + 1;
+      v = readbuf_(ctx, data, end);
+      if (!v) { fe_error(ctx, "stray '''"); }
+      if (v == &rparen) { fe_error(ctx, "stray ')'"); }
+      return fe_cons(ctx, fe_symbol(ctx, "quote"), fe_cons(ctx, v, &nil));
+
+    case '"':
+      /* runs of characters without escapes are copied in one go */
+      start = ++p;
+      while (p < end && *p != '"' && *p != '\\') { p++; }
+      res = buildstring(ctx, start, p - start);
+      while (p < end && *p == '\\') {
+        if (++p == end) { break; }
+        chr = *p && strchr("nrt", *p) ? strchr("n\nr\rt\t", *p)[1] : *p;
+        appendchar(ctx, res, chr);
+        start = ++p;
+        while (p < end && *p != '"' && *p != '\\') { p++; }
+        appendstring(ctx, res, start, p - start);
+      }
+      if (p == end) { fe_error(ctx, "unclosed string"); }
+      *data = p + 1;
+      return res;
+
+    default:
+      start = p;
+      while (p < end && !isdelim(*p)) { p++; }
+      *data = p;
+      /* integers short enough to be exact in a double are converted
+      ** directly; other atoms starting like a number are tried with
+      ** strtod() */
+      num = start + (*start == '-' || *start == '+');
+      for (d = 0, q = num; q < p && *q >= '0' && *q <= '9'; q++) {
+        d = d * 10 + (*q - '0');
+      }
+      if (q == p && q > num && q - num < 16) {
+        return fe_number(ctx, *start == '-' ? -d : d);
+      }
+      if (strchr("0123456789+-.iInN", *start) && p - start < (int) sizeof(buf)) {
+        memcpy(buf, start, p - start);
+        buf[p - start] = '\0';
+        n = strtod(buf, &e);
+        if (e != buf && *e == '\0') { return fe_number(ctx, n); }
+        if (!strcmp(buf, "nil")) { return &nil; }
+      }
+      if (p - start == 1 && *start == '#' && p < end && *p == '(') {
+        /* vector literal */
+        return listtovector(ctx, readbuf_(ctx, data, end));
+      }
+      return symbol(ctx, start, p - start);
+  }
+}
+
+
+fe_Object* fe_readbuf(fe_Context *ctx, const char **data, size_t *len) {
+  const char *end = *data + *len;
+  fe_Object *obj = readbuf_(ctx, data, end);
+  *len = end - *data;
+  if (obj == &rparen) { fe_error(ctx, "stray ')'"); }
+  return obj;
+}
+
+
+static fe_Object* eval(fe_Context *ctx, fe_Object *obj, fe_Object *env, fe_Object **bind);
+static fe_Object* vmcall(fe_Context *ctx, fe_Object *fn, fe_Object *args);
+static fe_Object* stackcall(fe_Context *ctx, fe_Object *fn, fe_Object *arg, fe_Object *env);
+
+static fe_Object* evallist(fe_Context *ctx, fe_Object *lst, fe_Object *env) {
+  fe_Object *res = &nil;
+  fe_Object **tail = &res;
+  while (!isnil(lst)) {
+    *tail = fe_cons(ctx, eval(ctx, fe_nextarg(ctx, &lst), env, NULL), &nil);
+    tail = &cdr(*tail);
+  }
+  return res;
+}
+
+
+static fe_Object* dolist(fe_Context *ctx, fe_Object *lst, fe_Object *env) {
+  fe_Object *res = &nil;
+  int save = fe_savegc(ctx);
+  while (!isnil(lst)) {
+    fe_restoregc(ctx, save);
+    fe_pushgc(ctx, lst);
+    fe_pushgc(ctx, env);
+    res = eval(ctx, fe_nextarg(ctx, &lst), env, &env);
+  }
+  return res;
+}
+
+
+static fe_Object* dobutlast(fe_Context *ctx, fe_Object *lst, fe_Object **env) {
+  /* like dolist() but returns the last form unevaluated, for the caller to
+  ** evaluate in tail position */
+  fe_Object *x;
+  int save = fe_savegc(ctx);
+  if (isnil(lst)) { return &nil; }
+  for (;;) {
+    fe_restoregc(ctx, save);
+    fe_pushgc(ctx, lst);
+    fe_pushgc(ctx, *env);
+    x = fe_nextarg(ctx, &lst);
+    if (isnil(lst)) { return x; }
+    eval(ctx, x, *env, env);
+  }
+}
+
+
+static fe_Object* argstoframe(fe_Context *ctx, fe_Object *lay, fe_Object *arg, fe_Object *env, int owned) {
+  /* a frame's slots hold the parameters followed by the fn's `let`s; an
+  ** evaluated (owned) argument list is reused in place for the parameters */
+  fe_Object *res = &nil, **tail = &res;
+  int i = 0;
+  if (owned) {
+    for (res = arg; i < layparams(lay) && !isnil(*tail); i++) {
+      tail = &cdr(*tail);
+    }
+    arg = *tail;
+    store(ctx, tail, &nil);
+  } else {
+    for (; i < layparams(lay) && !isnil(arg); i++) {
+      *tail = fe_cons(ctx, fe_car(ctx, arg), &nil);
+      tail = &cdr(*tail);
+      arg = fe_cdr(ctx, arg);
+    }
+  }
+  if (i == layparams(lay) && layrest(lay)) {
+    *tail = fe_cons(ctx, arg, &nil);
+    tail = &cdr(*tail);
+    i++;
+  }
+  for (; i < layslots(lay); i++) {
+    *tail = fe_cons(ctx, &nil, &nil);
+    tail = &cdr(*tail);
+  }
+  return fe_cons(ctx, fe_cons(ctx, lay, res), env);
+}
+
+
+static fe_Object* argstoenv(fe_Context *ctx, fe_Object *prm, fe_Object *arg, fe_Object *env, int owned) {
+  if (type(prm) == T_LAYOUT) {
+    return argstoframe(ctx, prm, arg, env, owned);
+  }
+  while (!isnil(prm)) {
+    if (type(prm) != FE_TPAIR) {
+      bindlocal(prm, LOCAL_NAME);
+      env = fe_cons(ctx, fe_cons(ctx, prm, arg), env);
+      break;
+    }
+    bindlocal(car(prm), LOCAL_NAME);
+    env = fe_cons(ctx, fe_cons(ctx, car(prm), fe_car(ctx, arg)), env);
+    prm = cdr(prm);
+    arg = fe_cdr(ctx, arg);
+  }
+  return env;
+}
+
+
+static fe_Object* expandmacro(fe_Context *ctx, fe_Object *mac, fe_Object *arg) {
+  fe_Object *va = cdr(mac); /* (env params ...) */
+  fe_Object *vb = cdr(va);  /* (params ...) */
+  if (type(vb) == T_CODE) { return vmcall(ctx, mac, arg); }
+  return dolist(ctx, cdr(vb), argstoenv(ctx, car(vb), arg, car(va), 0));
+}
+
+
+/* The resolver rewrites the body of a `fn` or `mac` the first time it is
+** evaluated: references to locals become (depth, slot) addresses into
+** frames and references to globals point straight at the symbol's value.
+** `let`s which could be captured afresh on each iteration of a `while` are
+** left to create bindings by name, as is any name the resolver can't see.
+**
+** A fn resolved along with the top level form it is in is made a flat
+** closure: rather than the whole environment it was created in it keeps a
+** cell for each variable it uses from enclosing fns, and its layout's names
+** end in a T_CAPTURES object listing where each cell is found in the
+** creating environment. A variable no `=` can reach is captured by value,
+** others share the slot or binding they live in. Code the resolver can't see
+** -- a call to anything but a known function may turn out to be a macro --
+** can still name any variable in scope, so a closure whose body, or that of
+** a fn within it, makes such a call keeps the creating environment behind
+** its cells */
+
+typedef struct { fe_Object *sym; int level, slot, assigned; } Binding;
+
+typedef struct Scope {
+  struct Scope *parent;
+  Binding *caps[MAXSLOTS];
+  fe_Object *captures, **tail;
+  int level, ncaps, chain;
+} Scope;
+
+typedef struct {
+  Binding binds[MAXBINDS];
+  int nbinds, level, open, flat;
+  fe_Object *layout, **names;
+  Scope *scope;
+} Resolver;
+
+static void resolve(fe_Context *ctx, Resolver *r, fe_Object **p, int dyn);
+
+
+static Binding* findbind(Resolver *r, fe_Object *sym) {
+  int i = r->nbinds;
+  while (i--) {
+    if (r->binds[i].sym == sym) { return &r->binds[i]; }
+  }
+  return NULL;
+}
+
+
+static fe_Object* globalof(Resolver *r, fe_Object *obj) {
+  if (type(obj) != FE_TSYMBOL || findbind(r, obj)) { return NULL; }
+  return cdr(cdr(obj));
+}
+
+
+static int isprim(fe_Object *obj, int p) {
+  return obj && type(obj) == FE_TPRIM && prim(obj) == p;
+}
+
+
+static int isfunction(fe_Object *obj) {
+  int t = type(obj);
+  return t == FE_TFUNC || t == FE_TPRIM || t == FE_TCFUNC;
+}
+
+
+static void bind(fe_Context *ctx, Resolver *r, fe_Object *sym, int slot) {
+  Binding *b;
+  if (r->nbinds == MAXBINDS) { fe_error(ctx, "too many local variables"); }
+  b = &r->binds[r->nbinds++];
+  b->sym = sym;
+  b->level = r->level;
+  b->slot = slot;
+  b->assigned = 1;
+}
+
+
+static fe_Object* nameof(fe_Object *obj) {
+  if (type(obj) == T_LOCAL || type(obj) == T_GLOBAL) { return cdr(obj); }
+  return obj;
+}
+
+
+static int assigns(fe_Object *sym, fe_Object *obj) {
+  /* true if `obj` may assign to `sym` -- calls to anything but a known
+  ** function are assumed to, as they may be macro calls */
+  fe_Object *v;
+  if (type(obj) != FE_TPAIR) { return 0; }
+  if (type(nameof(car(obj))) == FE_TSYMBOL) {
+    v = cdr(cdr(nameof(car(obj))));
+    if (isprim(v, P_QUOTE)) { return 0; }
+    if (!isfunction(v)) { return 1; }
+    if (isprim(v, P_SET) && type(cdr(obj)) == FE_TPAIR &&
+        nameof(car(cdr(obj))) == sym
+    ) {
+      return 1;
+    }
+  }
+  for (; type(obj) == FE_TPAIR; obj = cdr(obj)) {
+    if (assigns(sym, car(obj))) { return 1; }
+  }
+  return 0;
+}
+
+
+static int newslot(fe_Context *ctx, Resolver *r, fe_Object *sym,
+  fe_Object *scope
+) {
+  int gc, slot = layslots(r->layout);
+  if (slot == MAXSLOTS) { return -1; }
+  gc = fe_savegc(ctx);
+  *r->names = fe_cons(ctx, sym, &nil);
+  r->names = &cdr(*r->names);
+  fe_restoregc(ctx, gc);
+  layslots(r->layout) = slot + 1;
+  bindlocal(sym, LOCAL_SLOT);
+  bind(ctx, r, sym, slot);
+  if (r->flat) { r->binds[r->nbinds - 1].assigned = assigns(sym, scope); }
+  return slot;
+}
+
+
+static fe_Object* localref(fe_Context *ctx, fe_Object *sym, int depth,
+  int slot, int cell
+) {
+  fe_Object *ref = object(ctx);
+  settype(ref, T_LOCAL);
+  refdepth(ref) = depth;
+  refslot(ref) = slot;
+  refcell(ref) = cell;
+  cdr(ref) = sym;
+  return ref;
+}
+
+
+static int cellof(Binding *b) {
+  return b->slot < 0 ? CELL_CDR : b->assigned ? CELL_CAR : CELL_NONE;
+}
+
+
+static int capture(fe_Context *ctx, Scope *s, Binding *b) {
+  /* returns the slot of the cell for `b` in the flat closure of `s`; the
+  ** cell is found in the creating fn's frame, in its bindings by name or
+  ** among the cells it captured itself */
+  fe_Object *src;
+  int i, gc;
+  for (i = 0; i < s->ncaps; i++) {
+    if (s->caps[i] == b) { return i; }
+  }
+  if (s->ncaps == MAXSLOTS) { fe_error(ctx, "too many captured variables"); }
+  gc = fe_savegc(ctx);
+  if (b->level != s->parent->level) {
+    i = capture(ctx, s->parent, b);
+    src = localref(ctx, b->sym, 1, i, CELL_CAR);
+  } else if (b->slot < 0) {
+    src = b->sym;
+  } else {
+    i = b->assigned ? CELL_NONE : CELL_CAR;
+    src = localref(ctx, b->sym, 0, b->slot, i);
+  }
+  *s->tail = fe_cons(ctx, src, &nil);
+  s->tail = &cdr(*s->tail);
+  fe_restoregc(ctx, gc);
+  s->caps[s->ncaps] = b;
+  return s->ncaps++;
+}
+
+
+static fe_Object* makeref(fe_Context *ctx, Resolver *r, fe_Object *sym) {
+  Binding *b = findbind(r, sym);
+  fe_Object *ref;
+  if (b && r->flat && b->level < r->level) {
+    /* the frame above a flat closure's own is its captured cells */
+    int slot = capture(ctx, r->scope, b);
+    return localref(ctx, sym, 1, slot, cellof(b));
+  }
+  if (b) {
+    if (b->slot < 0 || r->level - b->level > 255) { return sym; }
+    return localref(ctx, sym, r->level - b->level, b->slot, CELL_NONE);
+  } else {
+    if (r->open) { return sym; }
+    ref = object(ctx);
+    settype(ref, T_GLOBAL);
+  }
+  cdr(ref) = sym;
+  return ref;
+}
+
+
+static int hasclosure(fe_Object *obj) {
+  /* true if `obj` may create a closure -- macro calls are assumed to */
+  for (; type(obj) == FE_TPAIR; obj = cdr(obj)) {
+    if (hasclosure(car(obj))) { return 1; }
+  }
+  if (type(obj) == FE_TSYMBOL) {
+    fe_Object *v = cdr(cdr(obj));
+    return isprim(v, P_FN) || isprim(v, P_MAC) || type(v) == FE_TMACRO;
+  }
+  return 0;
+}
+
+
+static void expand(fe_Context *ctx, Resolver *r, fe_Object **p) {
+  int gc = fe_savegc(ctx);
+  while (type(*p) == FE_TPAIR) {
+    fe_Object *fn = globalof(r, car(*p));
+    if (!fn || type(fn) != FE_TMACRO) { break; }
+    store(ctx, p, expandmacro(ctx, fn, cdr(*p)));
+    fe_restoregc(ctx, gc);
+  }
+}
+
+
+static void resolveblock(fe_Context *ctx, Resolver *r, fe_Object *lst, int dyn) {
+  int gc, nbinds = r->nbinds;
+  for (; type(lst) == FE_TPAIR; lst = cdr(lst)) {
+    fe_Object *x, *sym;
+    expand(ctx, r, &car(lst));
+    x = car(lst);
+    if (type(x) != FE_TPAIR || !isprim(globalof(r, car(x)), P_LET) ||
+        type(cdr(x)) != FE_TPAIR || type(sym = car(cdr(x))) != FE_TSYMBOL
+    ) {
+      resolve(ctx, r, &car(lst), dyn);
+      continue;
+    }
+    /* `let`: resolve the value before the new binding is visible */
+    resolve(ctx, r, &car(x), dyn);
+    resolve(ctx, r, &cdr(cdr(x)), dyn);
+    if (dyn || newslot(ctx, r, sym, cdr(lst)) < 0) {
+      bind(ctx, r, sym, -1);
+    } else {
+      gc = fe_savegc(ctx);
+      store(ctx, &car(cdr(x)), makeref(ctx, r, sym));
+      fe_restoregc(ctx, gc);
+    }
+  }
+  r->nbinds = nbinds;
+}
+
+
+static void resolvefn(fe_Context *ctx, Resolver *r, fe_Object *arg) {
+  fe_Object *prm, *layout = r->layout, **names = r->names;
+  int n = 0, nbinds = r->nbinds, gc = fe_savegc(ctx);
+  Scope scope;
+  /* only resolve unresolved fns whose parameters are all symbols */
+  if (type(arg) != FE_TPAIR || type(car(arg)) == T_LAYOUT) { return; }
+  for (prm = car(arg); type(prm) == FE_TPAIR; prm = cdr(prm)) {
+    if (type(car(prm)) != FE_TSYMBOL || ++n > MAXSLOTS) { return; }
+  }
+  if (!isnil(prm) && type(prm) != FE_TSYMBOL) { return; }
+  /* create layout, bind parameters and resolve body */
+  if (r->level == 0) { r->flat = !r->open; }
+  r->level++;
+  scope.parent = r->scope;
+  scope.level = r->level;
+  scope.ncaps = scope.chain = 0;
+  if (r->flat) {
+    scope.captures = object(ctx);
+    settype(scope.captures, T_CAPTURES);
+    cdr(scope.captures) = &nil;
+    scope.tail = &cdr(scope.captures);
+  }
+  r->scope = &scope;
+  r->layout = object(ctx);
+  settype(r->layout, T_LAYOUT);
+  layparams(r->layout) = n;
+  layrest(r->layout) = !isnil(prm);
+  layslots(r->layout) = 0;
+  cdr(r->layout) = &nil;
+  r->names = &cdr(r->layout);
+  for (prm = car(arg); type(prm) == FE_TPAIR; prm = cdr(prm)) {
+    newslot(ctx, r, car(prm), cdr(arg));
+  }
+  if (!isnil(prm)) { newslot(ctx, r, prm, cdr(arg)); }
+  resolveblock(ctx, r, cdr(arg), 0);
+  if (r->flat) {
+    capchain(scope.captures) = scope.chain;
+    *r->names = scope.captures;
+  }
+  store(ctx, &car(arg), r->layout);
+  /* restore outer fn's state */
+  r->scope = scope.parent;
+  r->level--;
+  r->layout = layout;
+  r->names = names;
+  r->nbinds = nbinds;
+  fe_restoregc(ctx, gc);
+}
+
+
+static void resolve(fe_Context *ctx, Resolver *r, fe_Object **p, int dyn) {
+  fe_Object *x, *fn;
+  int gc;
+  expand(ctx, r, p);
+  x = *p;
+  if (type(x) == FE_TSYMBOL) {
+    gc = fe_savegc(ctx);
+    store(ctx, p, makeref(ctx, r, x));
+    fe_restoregc(ctx, gc);
+    return;
+  }
+  if (type(x) != FE_TPAIR) { return; }
+  fn = globalof(r, car(x));
+  if (fn && !isfunction(fn) && r->flat) {
+    /* may be a macro by the time it is called: keep the environment */
+    Scope *s;
+    for (s = r->scope; s; s = s->parent) { s->chain = 1; }
+  }
+  if (fn && type(fn) == FE_TPRIM) {
+    switch (prim(fn)) {
+      case P_QUOTE: case P_LET:
+        return;
+      case P_FN: case P_MAC:
+        resolvefn(ctx, r, cdr(x));
+        resolve(ctx, r, &car(x), dyn);
+        return;
+      case P_DO:
+        resolveblock(ctx, r, cdr(x), dyn);
+        resolve(ctx, r, &car(x), dyn);
+        return;
+      case P_WHILE:
+        if (type(cdr(x)) != FE_TPAIR) { break; }
+        resolve(ctx, r, &car(cdr(x)), dyn);
+        x = cdr(cdr(x));
+        resolveblock(ctx, r, x, dyn || hasclosure(x));
+        resolve(ctx, r, &car(*p), dyn);
+        return;
+    }
+  }
+  for (; type(x) == FE_TPAIR; x = cdr(x)) {
+    resolve(ctx, r, &car(x), dyn);
+  }
+}
+
+
+static void initresolver(Resolver *r, int open) {
+  r->nbinds = r->level = r->flat = 0;
+  r->open = open;
+  r->layout = NULL;
+  r->names = NULL;
+  r->scope = NULL;
+}
+
+
+static fe_Object* capturedcell(fe_Object *src, fe_Object *env) {
+  /* a slot is shared by taking its node, or copied along with the cells of
+  ** the creating closure by taking its contents */
+  fe_Object *node;
+  if (type(src) == FE_TSYMBOL) {
+    /* a binding by name, or the global if the `let` has yet to happen */
+    for (; !isnil(env) && type(car(car(env))) != T_CAPTURES; env = cdr(env)) {
+      if (car(car(env)) == src) { return car(env); }
+    }
+    return cdr(src);
+  }
+  node = getnode(src, env);
+  return refcell(src) == CELL_NONE ? node : car(node);
+}
+
+
+static fe_Object* closureenv(fe_Context *ctx, fe_Object *arg, fe_Object *env) {
+  /* a flat closure's environment is an entry holding its captures and
+  ** cells, followed by the creating environment if it must be kept */
+  fe_Object *caps, *src, *outer, *res = &nil, **tail = &res;
+  int gc;
+  if (type(arg) != FE_TPAIR || type(car(arg)) != T_LAYOUT) { return env; }
+  for (caps = cdr(car(arg)); type(caps) == FE_TPAIR; caps = cdr(caps));
+  if (type(caps) != T_CAPTURES) { return env; }
+  outer = capchain(caps) ? env : &nil;
+  if (isnil(cdr(caps))) { return outer; }
+  gc = fe_savegc(ctx);
+  for (src = cdr(caps); !isnil(src); src = cdr(src)) {
+    *tail = fe_cons(ctx, capturedcell(car(src), env), &nil);
+    tail = &cdr(*tail);
+    fe_restoregc(ctx, gc);
+    fe_pushgc(ctx, res);
+  }
+  res = fe_cons(ctx, fe_cons(ctx, caps, res), outer);
+  fe_restoregc(ctx, gc);
+  fe_pushgc(ctx, res);
+  return res;
+}
+
+
+static fe_Object* resolveclosure(fe_Context *ctx, fe_Object *arg, fe_Object *env) {
+  Resolver r;
+  initresolver(&r, !isnil(env));
+  resolvefn(ctx, &r, arg);
+  return closureenv(ctx, arg, env);
+}
+
+
+/* fe_expand() does up front what evaluation would otherwise do to a form the
+** first time it reached each part of it: macro calls are expanded and fns
+** resolved, so evaluating the result never changes it. Inside the body of a
+** top level `do` or `while` a `let` may be in scope, so fns there are
+** resolved as they would be at run time, leaving free names to be looked up
+** by name */
+
+static void expandall(fe_Context *ctx, Resolver *r, fe_Object **p) {
+  fe_Object *x, *fn;
+  int open = r->open;
+  expand(ctx, r, p);
+  x = *p;
+  if (type(x) != FE_TPAIR) { return; }
+  fn = globalof(r, car(x));
+  if (fn && type(fn) == FE_TPRIM) {
+    switch (prim(fn)) {
+      case P_QUOTE:
+        return;
+      case P_FN: case P_MAC:
+        resolvefn(ctx, r, cdr(x));
+        return;
+      case P_DO: case P_WHILE:
+        r->open = 1;
+        break;
+    }
+  }
+  for (; type(x) == FE_TPAIR; x = cdr(x)) {
+    expandall(ctx, r, &car(x));
+  }
+  r->open = open;
+}
+
+
+fe_Object* fe_expand(fe_Context *ctx, fe_Object *obj) {
+  Resolver r;
+  fe_Object *holder;
+  int gc = fe_savegc(ctx);
+  /* the form is held in a pair in case the whole of it is a macro call */
+  holder = fe_cons(ctx, obj, &nil);
+  initresolver(&r, 0);
+  expandall(ctx, &r, &car(holder));
+  fe_restoregc(ctx, gc);
+  fe_pushgc(ctx, car(holder));
+  return car(holder);
+}
+
+
+#define evalarg() eval(ctx, fe_nextarg(ctx, &arg), env, NULL)
+
+#define arithop(op) {                             \
+    fe_Number x = fe_tonumber(ctx, evalarg());    \
+    while (!isnil(arg)) {                         \
+      x = x op fe_tonumber(ctx, evalarg());       \
+    }                                             \
+    res = fe_number(ctx, x);                      \
+  }
+
+#define numcmpop(op) {                            \
+    va = checktype(ctx, evalarg(), FE_TNUMBER);   \
+    vb = checktype(ctx, evalarg(), FE_TNUMBER);   \
+    res = fe_bool(ctx, number(va) op number(vb)); \
+  }
+
+
+static fe_Object* eval(fe_Context *ctx, fe_Object *obj, fe_Object *env, fe_Object **newenv) {
+  fe_Object *fn, *arg, *res;
+  fe_Object cl, *va, *vb, *scratch;
+  int n, gc, caller = -1;
+
+  switch (type(obj)) {
+    case FE_TPAIR: break;
+    case FE_TSYMBOL: return *getbound(obj, env);
+    case T_LOCAL: return *getslot(obj, env);
+    case T_GLOBAL: return cdr(cdr(cdr(obj)));
+    default: return obj;
+  }
+
+  car(&cl) = obj, cdr(&cl) = ctx->calllist;
+  ctx->calllist = &cl;
+
+  gc = fe_savegc(ctx);
+call:
+  /* an operator which is a name, or a reference the resolver made, is
+  ** looked up here rather than through a call to eval() */
+  va = car(obj);
+  switch (type(va)) {
+    case FE_TPAIR: fn = eval(ctx, va, env, NULL); break;
+    case FE_TSYMBOL: case T_LOCAL: case T_GLOBAL: fn = *getvar(va, env); break;
+    default: fn = va;
+  }
+  arg = cdr(obj);
+  res = &nil;
+
+  switch (type(fn)) {
+    case FE_TPRIM:
+      switch (prim(fn)) {
+        case P_LET:
+          va = fe_nextarg(ctx, &arg);
+          if (type(va) == T_LOCAL) {
+            vb = evalarg();
+            store(ctx, getslot(va, env), vb);
+            break;
+          }
+          checktype(ctx, va, FE_TSYMBOL);
+          if (newenv) {
+            bindlocal(va, LOCAL_NAME);
+            *newenv = fe_cons(ctx, fe_cons(ctx, va, evalarg()), env);
+          }
+          break;
+
+        case P_SET:
+          va = fe_nextarg(ctx, &arg);
+          if (type(va) != T_LOCAL && type(va) != T_GLOBAL) {
+            checktype(ctx, va, FE_TSYMBOL);
+          }
+          vb = evalarg();
+          store(ctx, getvar(va, env), vb);
+          break;
+
+        case P_IF:
+          while (!isnil(arg)) {
+            if (type(arg) == FE_TPAIR && isnil(cdr(arg))) {
+              /* a final condition without a branch is the result */
+              obj = fe_nextarg(ctx, &arg);
+              newenv = NULL;
+              goto tail;
+            }
+            va = evalarg();
+            if (!isnil(va)) {
+              obj = fe_nextarg(ctx, &arg);
+              newenv = NULL;
+              goto tail;
+            }
+            arg = cdr(arg);
+          }
+          break;
+
+        case P_FN: case P_MAC:
+          va = fe_cons(ctx, resolveclosure(ctx, arg, env), arg);
+          fe_nextarg(ctx, &arg);
+          res = object(ctx);
+          settype(res, prim(fn) == P_FN ? FE_TFUNC : FE_TMACRO);
+          cdr(res) = va;
+          break;
+
+        case P_WHILE:
+          va = fe_nextarg(ctx, &arg);
+          n = fe_savegc(ctx);
+          while (!isnil(eval(ctx, va, env, NULL))) {
+            dolist(ctx, arg, env);
+            fe_restoregc(ctx, n);
+          }
+          break;
+
+        case P_QUOTE:
+          res = fe_nextarg(ctx, &arg);
+          break;
+
+        case P_AND: case P_OR:
+          while (!isnil(arg)) {
+            va = fe_nextarg(ctx, &arg);
+            if (isnil(arg)) {
+              obj = va;
+              newenv = NULL;
+              goto tail;
+            }
+            res = eval(ctx, va, env, NULL);
+            if (isnil(res) == (prim(fn) == P_AND)) { break; }
+          }
+          break;
+
+        case P_DO:
+          obj = dobutlast(ctx, arg, &env);
+          newenv = &scratch;
+          goto tail;
+
+        case P_CONS:
+          va = evalarg();
+          res = fe_cons(ctx, va, evalarg());
+          break;
+
+        case P_CAR:
+          res = fe_car(ctx, evalarg());
+          break;
+
+        case P_CDR:
+          res = fe_cdr(ctx, evalarg());
+          break;
+
+        case P_SETCAR:
+          va = checktype(ctx, evalarg(), FE_TPAIR);
+          store(ctx, &car(va), evalarg());
+          break;
+
+        case P_SETCDR:
+          va = checktype(ctx, evalarg(), FE_TPAIR);
+          store(ctx, &cdr(va), evalarg());
+          break;
+
+        case P_LIST:
+          res = evallist(ctx, arg, env);
+          break;
+
+        case P_NOT:
+          res = fe_bool(ctx, isnil(evalarg()));
+          break;
+
+        case P_IS:
+          va = evalarg();
+          res = fe_bool(ctx, equal(va, evalarg()));
+          break;
+
+        case P_ATOM:
+          res = fe_bool(ctx, fe_type(ctx, evalarg()) != FE_TPAIR);
+          break;
+
+        case P_PRINT:
+          while (!isnil(arg)) {
+            fe_writefp(ctx, evalarg(), stdout);
+            if (!isnil(arg)) { fputc(' ', stdout); }
+          }
+          fputc('\n', stdout);
+          break;
+
+        case P_LT: numcmpop(<); break;
+        case P_LTE: numcmpop(<=); break;
+        case P_ADD: arithop(+); break;
+        case P_SUB: arithop(-); break;
+        case P_MUL: arithop(*); break;
+        case P_DIV: arithop(/); break;
+
+        case P_VECTOR:
+          res = listtovector(ctx, evallist(ctx, arg, env));
+          break;
+
+        case P_MAKEVEC:
+          va = evalarg();
+          res = newvector(ctx, va, isnil(arg) ? &nil : evalarg());
+          break;
+
+        case P_VECGET:
+          va = evalarg();
+          res = *vecslot(ctx, va, fe_tonumber(ctx, evalarg()));
+          break;
+
+        case P_VECSET:
+          va = evalarg();
+          vb = evalarg();
+          store(ctx, vecslot(ctx, va, fe_tonumber(ctx, vb)), evalarg());
+          break;
+
+        case P_VECLEN:
+          res = fe_number(ctx, fe_veclen(ctx, evalarg()));
+          break;
+
+        case P_TOVEC:
+          res = listtovector(ctx, evalarg());
+          break;
+
+        case P_TOLIST:
+          res = tolist(ctx, evalarg());
+          break;
+
+        case P_TABLE:
+          res = fe_table(ctx);
+          while (!isnil(arg)) {
+            va = evalarg();
+            fe_tabset(ctx, res, va, evalarg());
+          }
+          break;
+
+        case P_TABGET:
+          va = evalarg();
+          res = fe_tabget(ctx, va, evalarg());
+          if (!res) { res = &nil; }
+          break;
+
+        case P_TABSET:
+          va = evalarg();
+          vb = evalarg();
+          fe_tabset(ctx, va, vb, evalarg());
+          break;
+
+        case P_TABDEL:
+          va = evalarg();
+          fe_tabdel(ctx, va, evalarg());
+          break;
+
+        case P_TABLEN:
+          res = fe_number(ctx, fe_tablen(ctx, evalarg()));
+          break;
+
+        case P_TABKEYS:
+          res = tabkeys(ctx, evalarg());
+          break;
+
+        case P_MAKEARR:
+          va = evalarg();
+          res = newarray(ctx, va, isnil(arg) ? &nil : evalarg());
+          break;
+
+        case P_TOARR:
+          res = toarray(ctx, evalarg());
+          break;
+
+        case P_ARRGET:
+          va = evalarg();
+          res = fe_number(ctx, *arrslot(ctx, va, fe_tonumber(ctx, evalarg())));
+          break;
+
+        case P_ARRSET:
+          va = evalarg();
+          vb = evalarg();
+          *arrslot(ctx, va, fe_tonumber(ctx, vb)) = fe_tonumber(ctx, evalarg());
+          break;
+
+        case P_ARRLEN:
+          res = fe_number(ctx, fe_arrlen(ctx, evalarg()));
+          break;
+
+        case P_COROUTINE:
+          res = fe_coroutine(ctx, evalarg());
+          break;
+
+        case P_RESUME:
+          va = evalarg();
+          res = fe_resume(ctx, va, isnil(arg) ? &nil : evalarg());
+          break;
+
+        case P_YIELD:
+          /* evaluation recurses in C, so can't be suspended */
+          if (!ctx->co) { fe_error(ctx, "yield outside of a coroutine"); }
+          fe_error(ctx, "cannot yield from evaluated code");
+          break;
+
+        case P_COSTATUS:
+          va = evalarg();
+          res = fe_symbol(ctx, costatenames[fe_costatus(ctx, va)]);
+          break;
+
+        default: {
+          fe_Object *args[4];
+          for (n = 0; n < arrargs[prim(fn) - P_ARRFILL]; n++) {
+            args[n] = evalarg();
+          }
+          res = arrayop(ctx, prim(fn), args);
+          break;
+        }
+      }
+      break;
+
+    case FE_TCFUNC:
+      callenter(ctx, &caller, fn);
+      if (isargv(fn)) {
+        res = stackcall(ctx, fn, arg, env);
+        break;
+      }
+      arg = evallist(ctx, arg, env);
+      res = cfunc(fn)(ctx, arg);
+      break;
+
+    case FE_TFUNC:
+      va = cdr(fn); /* (env params ...) */
+      vb = cdr(va); /* (params ...) */
+      if (type(vb) == T_CODE) {
+        if (caller >= 0) { callleave(ctx, caller); caller = -1; }
+        res = stackcall(ctx, fn, arg, env);
+        break;
+      }
+      arg = evallist(ctx, arg, env);
+      callenter(ctx, &caller, vb);
+      env = argstoenv(ctx, car(vb), arg, car(va), 1);
+      obj = dobutlast(ctx, cdr(vb), &env);
+      newenv = &scratch;
+      goto tail;
+
+    case FE_TMACRO:
+      /* replace caller object with code generated by macro and re-eval. Only
+      ** a pair can be copied over it: any other expansion may own a byte
+      ** block or be an immediate number, so it is wrapped as (do expansion) */
+      va = expandmacro(ctx, fn, arg);
+      if (type(va) != FE_TPAIR) {
+        vb = object(ctx);
+        settype(vb, FE_TPRIM);
+        prim(vb) = P_DO;
+        va = fe_cons(ctx, vb, fe_cons(ctx, va, &nil));
+      }
+      fe_mark(ctx, car(obj));
+      fe_mark(ctx, cdr(obj));
+      *obj = *va;
+      newenv = NULL;
+      goto tail;
+
+    default:
+      fe_error(ctx, "tried to call non-callable value");
+  }
+
+done:
+  fe_restoregc(ctx, gc);
+  fe_pushgc(ctx, res);
+  ctx->calllist = cdr(&cl);
+  if (caller >= 0) { callleave(ctx, caller); }
+  return res;
+
+tail:
+  /* evaluate `obj` in place of this call, reusing its frame */
+  fe_restoregc(ctx, gc);
+  fe_pushgc(ctx, obj);
+  fe_pushgc(ctx, env);
+  if (type(obj) != FE_TPAIR) {
+    res = eval(ctx, obj, env, NULL);
+    goto done;
+  }
+  car(&cl) = obj;
+  goto call;
+}
+
+
+fe_Object* fe_eval(fe_Context *ctx, fe_Object *obj) {
+  return eval(ctx, obj, &nil, NULL);
+}
+
+
+/* The compiler turns a form into bytecode for a small stack machine. Each
+** `fn` and `mac` becomes a code object holding its constants, the captures
+** a closure of it takes from its parent and its instructions; a compiled
+** closure is a func or macro whose cdr is (captures . code). Locals live in
+** slots on the vm's stack; a local which may be captured by a nested
+** closure is kept in a box -- a pair whose car holds the value -- which the
+** closure shares. Instructions take at most one 16 bit little-endian
+** operand. Macros are expanded and primitives inlined when the code is
+** compiled, so both must be defined by then */
+
+enum {
+  OP_NIL, OP_CONST, OP_LOCAL, OP_SETLOCAL, OP_BOXED, OP_SETBOXED, OP_BOX,
+  OP_MKBOX, OP_UPVAL, OP_SETUPVAL, OP_GLOBAL, OP_SETGLOBAL, OP_POP, OP_JMP,
+  OP_JMPNIL, OP_ANDJMP, OP_ORJMP, OP_CLOSURE, OP_MACRO, OP_CALL, OP_TAILCALL,
+  OP_RET, OP_CONS, OP_CAR, OP_CDR, OP_SETCAR, OP_SETCDR, OP_LIST, OP_NOT,
+  OP_IS, OP_ATOM, OP_PRINT, OP_LT, OP_LTE, OP_ADD, OP_SUB, OP_MUL, OP_DIV,
+  OP_PRINTEND, OP_JMPNLT, OP_JMPNLTE, OP_VECTOR, OP_MAKEVEC, OP_VECGET,
+  OP_VECSET, OP_VECLEN, OP_TOVEC, OP_TOLIST, OP_TABLE, OP_TABGET, OP_TABSET,
+  OP_TABDEL, OP_TABLEN, OP_TABKEYS, OP_MAKEARR, OP_TOARR, OP_ARRGET, OP_ARRSET,
+  OP_ARRLEN, OP_ARROP, OP_COROUTINE, OP_RESUME, OP_YIELD, OP_COSTATUS
+};
+
+typedef struct { fe_Object *sym; int boxed; } Local;
+
+typedef struct Compiler {
+  struct Compiler *parent;
+  fe_Context *ctx;
+  fe_Object *holder, **ktail;
+  Local locals[MAXLOCALS];
+  fe_Object *capsyms[MAXLOCALS];
+  int caps[MAXLOCALS];
+  int nk, nlocals, nslots, ncaps, nparams, rest;
+  int depth, maxstack, ncode, lastop, label;
+  unsigned char code[MAXCODE];
+} Compiler;
+
+static void compile(Compiler *c, fe_Object *x, int tail);
+static void compileblock(Compiler *c, fe_Object *lst, int tail);
+
+
+static void initcompiler(Compiler *c, fe_Context *ctx, Compiler *parent) {
+  memset(c, 0, offsetof(Compiler, code));
+  c->ctx = ctx;
+  c->parent = parent;
+  c->lastop = c->label = -1;
+  c->holder = fe_cons(ctx, &nil, &nil); /* (constants . expansions) */
+  c->ktail = &car(c->holder);
+}
+
+
+static void emit(Compiler *c, int op, int effect) {
+  if (c->ncode + 3 > MAXCODE) { fe_error(c->ctx, "function too large"); }
+  c->lastop = c->ncode;
+  c->code[c->ncode++] = op;
+  c->depth += effect;
+  if (c->depth > c->maxstack) { c->maxstack = c->depth; }
+}
+
+
+static void emitarg(Compiler *c, int op, int arg, int effect) {
+  emit(c, op, effect);
+  c->code[c->ncode++] = arg & 0xff;
+  c->code[c->ncode++] = arg >> 8;
+}
+
+
+static void emitpop(Compiler *c) {
+  /* a `nil` which is immediately discarded is never pushed */
+  if (c->lastop >= 0 && c->lastop >= c->label && c->code[c->lastop] == OP_NIL) {
+    c->ncode = c->lastop;
+    c->lastop = -1;
+    c->depth--;
+    return;
+  }
+  emit(c, OP_POP, -1);
+}
+
+
+static int emitjump(Compiler *c, int op, int chain, int effect) {
+  /* unpatched jumps to the same place are chained through their operands;
+  ** a comparison followed by a `JMPNIL` becomes a single instruction */
+  int last = c->lastop >= 0 && c->lastop >= c->label ? c->code[c->lastop] : -1;
+  if (op == OP_JMPNIL && (last == OP_LT || last == OP_LTE)) {
+    c->ncode = c->lastop;
+    c->depth++;
+    op = last == OP_LT ? OP_JMPNLT : OP_JMPNLTE;
+    effect = -2;
+  }
+  emitarg(c, op, chain & 0xffff, effect);
+  return c->ncode - 2;
+}
+
+
+static void patch(Compiler *c, int chain) {
+  while (chain >= 0 && chain != 0xffff) {
+    int next = c->code[chain] | c->code[chain + 1] << 8;
+    c->code[chain] = c->ncode & 0xff;
+    c->code[chain + 1] = c->ncode >> 8;
+    chain = next;
+  }
+  c->label = c->ncode;
+}
+
+
+static int addconst(Compiler *c, fe_Object *obj) {
+  fe_Object *k = car(c->holder);
+  int i;
+  for (i = 0; i < c->nk; i++, k = cdr(k)) {
+    if (car(k) == obj) { return i; }
+  }
+  if (c->nk == 0xffff) { fe_error(c->ctx, "too many constants"); }
+  *c->ktail = fe_cons(c->ctx, obj, &nil);
+  c->ktail = &cdr(*c->ktail);
+  return c->nk++;
+}
+
+
+static void keep(Compiler *c, fe_Object *obj) {
+  store(c->ctx, &cdr(c->holder), fe_cons(c->ctx, obj, cdr(c->holder)));
+}
+
+
+static fe_Object* unwrap(fe_Object *obj) {
+  /* code which has been through the resolver is compiled by name */
+  if (type(obj) == T_LOCAL || type(obj) == T_GLOBAL) { return cdr(obj); }
+  return obj;
+}
+
+
+static int findlocal(Compiler *c, fe_Object *sym) {
+  int i = c->nlocals;
+  while (i--) {
+    if (c->locals[i].sym == sym) { return i; }
+  }
+  return -1;
+}
+
+
+static int findcap(Compiler *c, fe_Object *sym) {
+  int i, cap;
+  for (i = 0; i < c->ncaps; i++) {
+    if (c->capsyms[i] == sym) { return i; }
+  }
+  if (!c->parent) { return -1; }
+  if ((i = findlocal(c->parent, sym)) >= 0) {
+    /* an unboxed local can only be captured by value */
+    cap = i << 2 | (c->parent->locals[i].boxed ? 1 : 2);
+  } else if ((i = findcap(c->parent, sym)) >= 0) {
+    cap = i << 2;
+  } else {
+    return -1;
+  }
+  if (c->ncaps == MAXLOCALS) { fe_error(c->ctx, "too many captured variables"); }
+  c->capsyms[c->ncaps] = sym;
+  c->caps[c->ncaps] = cap;
+  return c->ncaps++;
+}
+
+
+static fe_Object* globalval(Compiler *c, fe_Object *sym) {
+  /* the global value of `sym` if no local of an enclosing fn shadows it */
+  Compiler *p;
+  if (type(sym) != FE_TSYMBOL) { return NULL; }
+  for (p = c; p; p = p->parent) {
+    if (findlocal(p, sym) >= 0) { return NULL; }
+  }
+  return cdr(cdr(sym));
+}
+
+
+static int captured(fe_Object *sym, fe_Object *obj, int inner) {
+  /* conservatively true if `sym` may be referenced from a closure created
+  ** within `obj` -- macro calls are assumed to create one */
+  fe_Object *v;
+  obj = unwrap(obj);
+  if (type(obj) != FE_TPAIR) { return inner && obj == sym; }
+  if (type(unwrap(car(obj))) == FE_TSYMBOL) {
+    v = cdr(cdr(unwrap(car(obj))));
+    if (isprim(v, P_QUOTE)) { return 0; }
+    if (isprim(v, P_FN) || isprim(v, P_MAC) || type(v) == FE_TMACRO) {
+      inner = 1;
+    }
+  }
+  for (; type(obj) == FE_TPAIR; obj = cdr(obj)) {
+    if (captured(sym, car(obj), inner)) { return 1; }
+  }
+  return inner && unwrap(obj) == sym;
+}
+
+
+static int addlocal(Compiler *c, fe_Object *sym, fe_Object *scope) {
+  checktype(c->ctx, sym, FE_TSYMBOL);
+  if (c->nlocals == MAXLOCALS) { fe_error(c->ctx, "too many local variables"); }
+  c->locals[c->nlocals].sym = sym;
+  c->locals[c->nlocals].boxed = captured(sym, scope, 0);
+  if (++c->nlocals > c->nslots) { c->nslots = c->nlocals; }
+  return c->nlocals - 1;
+}
+
+
+static void compilesym(Compiler *c, fe_Object *sym, int set) {
+  int i = findlocal(c, sym), effect = set ? -1 : 1;
+  if (i >= 0) {
+    if (c->locals[i].boxed) {
+      emitarg(c, set ? OP_SETBOXED : OP_BOXED, i, effect);
+    } else {
+      emitarg(c, set ? OP_SETLOCAL : OP_LOCAL, i, effect);
+    }
+  } else if ((i = findcap(c, sym)) >= 0) {
+    emitarg(c, set ? OP_SETUPVAL : OP_UPVAL, i, effect);
+  } else {
+    emitarg(c, set ? OP_SETGLOBAL : OP_GLOBAL, addconst(c, sym), effect);
+  }
+}
+
+
+static fe_Object* expandform(Compiler *c, fe_Object *x) {
+  fe_Object *v;
+  int gc = fe_savegc(c->ctx);
+  while (type(x) == FE_TPAIR) {
+    v = globalval(c, unwrap(car(x)));
+    if (!v || type(v) != FE_TMACRO) { break; }
+    x = expandmacro(c->ctx, v, cdr(x));
+    keep(c, x);
+    fe_restoregc(c->ctx, gc);
+  }
+  return x;
+}
+
+
+static fe_Object* finish(Compiler *c) {
+  fe_Object *obj, *k = car(c->holder);
+  Proto *p;
+  int i;
+  obj = object(c->ctx);
+  settype(obj, T_CODE);
+  bytes(obj) = NULL;
+  p = allocbytes(c->ctx, PROTOSIZE + c->nk * sizeof(fe_Object*) +
+                 c->ncaps * sizeof(int) + c->ncode);
+  p->nk = c->nk;
+  p->ncaps = c->ncaps;
+  p->nparams = c->nparams;
+  p->rest = c->rest;
+  p->nslots = c->nslots;
+  p->maxstack = c->maxstack;
+  p->ncode = c->ncode;
+  p->toplevel = !c->parent;
+  for (i = 0; i < c->nk; i++, k = cdr(k)) { protok(p)[i] = car(k); }
+  memcpy(protocaps(p), c->caps, c->ncaps * sizeof(int));
+  memcpy(protocode(p), c->code, c->ncode);
+  bytes(obj) = p;
+  return obj;
+}
+
+
+static void compilefn(Compiler *c, fe_Object *arg, int op) {
+  Compiler fc;
+  fe_Object *prm, *body;
+  int i, gc = fe_savegc(c->ctx);
+  initcompiler(&fc, c->ctx, c);
+  prm = fe_nextarg(c->ctx, &arg);
+  body = arg;
+  if (type(prm) == T_LAYOUT) {
+    /* a resolved fn's parameters are the first of its layout's names */
+    fe_Object *names = cdr(prm);
+    for (i = 0; i < layparams(prm); i++, names = cdr(names)) {
+      addlocal(&fc, car(names), body);
+    }
+    fc.nparams = layparams(prm);
+    prm = layrest(prm) ? car(names) : &nil;
+  } else {
+    for (; type(prm) == FE_TPAIR; prm = cdr(prm)) {
+      addlocal(&fc, unwrap(car(prm)), body);
+      fc.nparams++;
+    }
+  }
+  if (!isnil(prm)) {
+    addlocal(&fc, unwrap(prm), body);
+    fc.rest = 1;
+  }
+  for (i = 0; i < fc.nlocals; i++) {
+    if (fc.locals[i].boxed) { emitarg(&fc, OP_BOX, i, 0); }
+  }
+  compileblock(&fc, body, 1);
+  emit(&fc, OP_RET, -1);
+  i = addconst(c, finish(&fc));
+  emitarg(c, op, i, 1);
+  fe_restoregc(c->ctx, gc);
+}
+
+
+static void compileblock(Compiler *c, fe_Object *lst, int tail) {
+  fe_Context *ctx = c->ctx;
+  fe_Object *x, *sym;
+  int i, last, nlocals = c->nlocals, gc = fe_savegc(ctx);
+  if (isnil(lst)) { emit(c, OP_NIL, 1); }
+  while (!isnil(lst)) {
+    fe_restoregc(ctx, gc);
+    x = expandform(c, fe_nextarg(ctx, &lst));
+    last = isnil(lst);
+    if (type(x) == FE_TPAIR && isprim(globalval(c, unwrap(car(x))), P_LET)) {
+      /* `let`: compile the value before the new local is visible */
+      x = cdr(x);
+      sym = unwrap(fe_nextarg(ctx, &x));
+      compile(c, fe_nextarg(ctx, &x), 0);
+      i = addlocal(c, sym, lst);
+      emitarg(c, c->locals[i].boxed ? OP_MKBOX : OP_SETLOCAL, i, -1);
+      if (last) { emit(c, OP_NIL, 1); }
+      continue;
+    }
+    compile(c, x, tail && last);
+    if (!last) { emitpop(c); }
+  }
+  c->nlocals = nlocals;
+  fe_restoregc(ctx, gc);
+}
+
+
+static int countargs(fe_Object *arg) {
+  int n = 0;
+  for (; type(arg) == FE_TPAIR; arg = cdr(arg)) { n++; }
+  return n;
+}
+
+
+static void compileargs(Compiler *c, fe_Object *arg, int n) {
+  while (n--) { compile(c, fe_nextarg(c->ctx, &arg), 0); }
+}
+
+
+static int compileprim(Compiler *c, int p, fe_Object *arg, int tail) {
+  /* returns 0 if the call must be left to the primitive at run time */
+  fe_Context *ctx = c->ctx;
+  fe_Object *x;
+  int n = countargs(arg), chain = -1, next;
+  switch (p) {
+    case P_LET:
+      /* a `let` outside of a block binds nothing */
+      emit(c, OP_NIL, 1);
+      break;
+
+    case P_SET:
+      x = unwrap(fe_nextarg(ctx, &arg));
+      checktype(ctx, x, FE_TSYMBOL);
+      compile(c, fe_nextarg(ctx, &arg), 0);
+      compilesym(c, x, 1);
+      emit(c, OP_NIL, 1);
+      break;
+
+    case P_IF:
+      n = c->depth;
+      while (!isnil(arg)) {
+        /* a condition without a branch is the result if reached */
+        x = fe_nextarg(ctx, &arg);
+        compile(c, x, tail && isnil(arg));
+        if (isnil(arg)) { break; }
+        next = emitjump(c, OP_JMPNIL, -1, -1);
+        compile(c, fe_nextarg(ctx, &arg), tail);
+        if (tail) {
+          emit(c, OP_RET, -1);
         } else {
-          /* proper pair */
-          *tail = fe_cons(ctx, v, &nil);
-          tail = &cdr(*tail);
+          chain = emitjump(c, OP_JMP, chain, -1);
         }
-        fe_restoregc(ctx, gc);
-        fe_pushgc(ctx, res);
+        patch(c, next);
       }
-      return res;
+      if (c->depth == n) { emit(c, OP_NIL, 1); }
+      patch(c, chain);
+      break;
 
-    case '\'':
-      v = fe_read(ctx, fn, udata);
-      if (!v) { fe_error(ctx, "stray '''"); }
-      return fe_cons(ctx, fe_symbol(ctx, "quote"), fe_cons(ctx, v, &nil));
+    case P_FN: case P_MAC:
+      compilefn(c, arg, p == P_FN ? OP_CLOSURE : OP_MACRO);
+      break;
 
-    case '"':
-      res = buildstring(ctx, NULL, '\0');
-      v = res;
-      chr = fn(ctx, udata);
-      while (chr != '"') {
-        if (chr == '\0') { fe_error(ctx, "unclosed string"); }
-        if (chr == '\\') {
-          chr = fn(ctx, udata);
-          if (strchr("nrt", chr)) { chr = strchr("n\nr\rt\t", chr)[1]; }
-        }
-        v = buildstring(ctx, v, chr);
-        chr = fn(ctx, udata);
+    case P_WHILE:
+      next = c->ncode;
+      patch(c, -1);
+      compile(c, fe_nextarg(ctx, &arg), 0);
+      chain = emitjump(c, OP_JMPNIL, -1, -1);
+      compileblock(c, arg, 0);
+      emitpop(c);
+      emitarg(c, OP_JMP, next, 0);
+      patch(c, chain);
+      emit(c, OP_NIL, 1);
+      break;
+
+    case P_QUOTE:
+      emitarg(c, OP_CONST, addconst(c, fe_nextarg(ctx, &arg)), 1);
+      break;
+
+    case P_AND: case P_OR:
+      if (isnil(arg)) { emit(c, OP_NIL, 1); break; }
+      for (;;) {
+        x = fe_nextarg(ctx, &arg);
+        compile(c, x, tail && isnil(arg));
+        if (isnil(arg)) { break; }
+        chain = emitjump(c, p == P_AND ? OP_ANDJMP : OP_ORJMP, chain, -1);
       }
-      return res;
+      patch(c, chain);
+      break;
+
+    case P_DO:
+      compileblock(c, arg, tail);
+      break;
+
+    case P_CONS: case P_SETCAR: case P_SETCDR: case P_IS: case P_LT:
+    case P_LTE:
+      if (n < 2) { return 0; }
+      compileargs(c, arg, 2);
+      emit(c, OP_CONS + p - P_CONS, -1);
+      break;
+
+    case P_CAR: case P_CDR: case P_NOT: case P_ATOM:
+      if (n < 1) { return 0; }
+      compileargs(c, arg, 1);
+      emit(c, OP_CONS + p - P_CONS, 0);
+      break;
+
+    case P_LIST:
+      compileargs(c, arg, n);
+      emitarg(c, OP_LIST, n, 1 - n);
+      break;
+
+    case P_PRINT:
+      while (!isnil(arg)) {
+        compile(c, fe_nextarg(ctx, &arg), 0);
+        emitarg(c, OP_PRINT, !isnil(arg), -1);
+      }
+      emit(c, OP_PRINTEND, 1);
+      break;
+
+    case P_ADD: case P_SUB: case P_MUL: case P_DIV:
+      if (n < 1) { return 0; }
+      compileargs(c, arg, n);
+      emitarg(c, OP_ADD + p - P_ADD, n, 1 - n);
+      break;
+
+    case P_VECTOR:
+      compileargs(c, arg, n);
+      emitarg(c, OP_VECTOR, n, 1 - n);
+      break;
+
+    case P_MAKEVEC:
+      if (n < 1) { return 0; }
+      compileargs(c, arg, n < 2 ? 1 : 2);
+      if (n < 2) { emit(c, OP_NIL, 1); }
+      emit(c, OP_MAKEVEC, -1);
+      break;
+
+    case P_VECGET:
+      if (n < 2) { return 0; }
+      compileargs(c, arg, 2);
+      emit(c, OP_VECGET, -1);
+      break;
+
+    case P_VECSET:
+      if (n < 3) { return 0; }
+      compileargs(c, arg, 3);
+      emit(c, OP_VECSET, -2);
+      break;
+
+    case P_VECLEN: case P_TOVEC: case P_TOLIST:
+      if (n < 1) { return 0; }
+      compileargs(c, arg, 1);
+      emit(c, OP_VECLEN + p - P_VECLEN, 0);
+      break;
+
+    case P_TABLE:
+      if (n % 2) { return 0; }
+      compileargs(c, arg, n);
+      emitarg(c, OP_TABLE, n, 1 - n);
+      break;
+
+    case P_TABGET: case P_TABDEL:
+      if (n < 2) { return 0; }
+      compileargs(c, arg, 2);
+      emit(c, p == P_TABGET ? OP_TABGET : OP_TABDEL, -1);
+      break;
+
+    case P_TABSET:
+      if (n < 3) { return 0; }
+      compileargs(c, arg, 3);
+      emit(c, OP_TABSET, -2);
+      break;
+
+    case P_TABLEN: case P_TABKEYS:
+      if (n < 1) { return 0; }
+      compileargs(c, arg, 1);
+      emit(c, p == P_TABLEN ? OP_TABLEN : OP_TABKEYS, 0);
+      break;
+
+    case P_MAKEARR:
+      if (n < 1) { return 0; }
+      compileargs(c, arg, n < 2 ? 1 : 2);
+      if (n < 2) { emit(c, OP_NIL, 1); }
+      emit(c, OP_MAKEARR, -1);
+      break;
+
+    case P_TOARR: case P_ARRLEN:
+      if (n < 1) { return 0; }
+      compileargs(c, arg, 1);
+      emit(c, p == P_TOARR ? OP_TOARR : OP_ARRLEN, 0);
+      break;
+
+    case P_ARRGET:
+      if (n < 2) { return 0; }
+      compileargs(c, arg, 2);
+      emit(c, OP_ARRGET, -1);
+      break;
+
+    case P_ARRSET:
+      if (n < 3) { return 0; }
+      compileargs(c, arg, 3);
+      emit(c, OP_ARRSET, -2);
+      break;
+
+    case P_COROUTINE: case P_COSTATUS:
+      if (n < 1) { return 0; }
+      compileargs(c, arg, 1);
+      emit(c, p == P_COROUTINE ? OP_COROUTINE : OP_COSTATUS, 0);
+      break;
+
+    case P_RESUME:
+      if (n < 1) { return 0; }
+      compileargs(c, arg, n < 2 ? 1 : 2);
+      if (n < 2) { emit(c, OP_NIL, 1); }
+      emit(c, OP_RESUME, -1);
+      break;
+
+    case P_YIELD:
+      /* the value passed to the next resume is left in place of the yield's */
+      compileargs(c, arg, n < 1 ? 0 : 1);
+      if (n < 1) { emit(c, OP_NIL, 1); }
+      emit(c, OP_YIELD, 0);
+      break;
 
     default:
-      p = buf;
-      do {
-        if (p == buf + sizeof(buf) - 1) { fe_error(ctx, "symbol too long"); }
-        *p++ = chr;
-        chr = fn(ctx, udata);
-      } while (chr && !strchr(delimiter, chr));
-      *p = '\0';
-      ctx->nextchr = chr;
-      n = strtod(buf, &p);  /* try to read as number */
-      if (p != buf && strchr(delimiter, *p)) { return fe_number(ctx, n); }
-      if (!strcmp(buf, "nil")) { return &nil; }
-      return fe_symbol(ctx, buf);
+      /* the bulk array primitives share one instruction */
+      if (p < P_ARRFILL) { return 0; }
+      next = arrargs[p - P_ARRFILL];
+      if (n < next) { return 0; }
+      compileargs(c, arg, next);
+      emitarg(c, OP_ARROP, p, 1 - next);
+      break;
   }
+  return 1;
 }
 
 
-fe_Object* fe_read(fe_Context *ctx, fe_ReadFn fn, void *udata) {
-  fe_Object* obj = read_(ctx, fn, udata);
-  if (obj == &rparen) { fe_error(ctx, "stray ')'"); }
-  return obj;
-}
+static void compile(Compiler *c, fe_Object *x, int tail) {
+  fe_Context *ctx = c->ctx;
+  fe_Object *fn, *arg;
+  int n, gc = fe_savegc(ctx);
 
+  x = expandform(c, unwrap(x));
+  switch (type(x)) {
+    case FE_TPAIR: break;
+    case FE_TNIL: emit(c, OP_NIL, 1); return;
+    case FE_TSYMBOL: compilesym(c, x, 0); return;
+    default: emitarg(c, OP_CONST, addconst(c, x), 1); return;
+  }
 
-static char readfp(fe_Context *ctx, void *udata) {
-  int chr;
-  unused(ctx);
-  return (chr = fgetc(udata)) == EOF ? '\0' : chr;
+  fn = globalval(c, unwrap(car(x)));
+  arg = cdr(x);
+  if (fn && type(fn) == FE_TPRIM && compileprim(c, prim(fn), arg, tail)) {
+    fe_restoregc(ctx, gc);
+    return;
+  }
+
+  /* call */
+  compile(c, car(x), 0);
+  for (n = 0; !isnil(arg); n++) {
+    compile(c, fe_nextarg(ctx, &arg), 0);
+  }
+  emitarg(c, tail ? OP_TAILCALL : OP_CALL, n, -n);
+  fe_restoregc(ctx, gc);
 }
 
-fe_Object* fe_readfp(fe_Context *ctx, FILE *fp) {
-  return fe_read(ctx, readfp, fp);
+
+/* The vm keeps every frame's slots and temporaries on one stack, so calls
+** between compiled closures don't recurse in C; a frame's closure sits in
+** the stack entry just below its base */
+
+static VM* getvm(fe_Context *ctx) {
+  fe_Object *obj;
+  VM *vm;
+  if (ctx->vm) { return bytes(ctx->vm); }
+  obj = object(ctx);
+  settype(obj, T_BYTES);
+  bytes(obj) = NULL;
+  vm = bytes(obj) = allocbytes(ctx, sizeof(VM));
+  vm->sp = vm->nframes = 0;
+  ctx->vm = obj;
+  return vm;
 }
 
 
-static fe_Object* eval(fe_Context *ctx, fe_Object *obj, fe_Object *env, fe_Object **bind);
+static void vmenter(fe_Context *ctx, VM *vm, int base, int n, int tail) {
+  /* enters the compiled closure at stack[base - 1] with `n` arguments; a
+  ** tail call replaces the current frame */
+  fe_Object *lst, **args = &vm->stack[base];
+  Proto *p = proto(cdr(cdr(vm->stack[base - 1])));
+  Frame *f;
+  int i, gc;
+  if (base + p->nslots + p->maxstack > VMSTACKSIZE ||
+      (!tail && vm->nframes == VMFRAMES)
+  ) {
+    fe_error(ctx, "stack overflow");
+  }
+  vm->sp = base + n;
+  if (p->rest) {
+    lst = &nil;
+    gc = fe_savegc(ctx);
+    for (i = n; i-- > p->nparams;) {
+      lst = fe_cons(ctx, args[i], lst);
+      fe_restoregc(ctx, gc);
+      fe_pushgc(ctx, lst);
+    }
+    for (i = n; i < p->nparams; i++) { args[i] = &nil; }
+    args[p->nparams] = lst;
+    n = p->nparams + 1;
+    fe_restoregc(ctx, gc);
+  } else if (n > p->nparams) {
+    n = p->nparams;
+  }
+  for (i = n; i < p->nslots; i++) { args[i] = &nil; }
+  vm->sp = base + p->nslots;
+  f = &vm->frames[tail ? vm->nframes - 1 : vm->nframes++];
+  f->pc = protocode(p);
+  f->base = base;
+  if (!tail) {
+    f->prof = ctx->profcur;
+    if (++ctx->calldepth > ctx->calldepth_max) {
+      ctx->calldepth_max = ctx->calldepth;
+    }
+  }
+  /* code compiled by fe_compile() is profiled as part of its caller */
+  if (ctx->prof && !p->toplevel) {
+    profenter(ctx, f->prof, cdr(cdr(vm->stack[base - 1])));
+  }
+}
 
-static fe_Object* evallist(fe_Context *ctx, fe_Object *lst, fe_Object *env) {
-  fe_Object *res = &nil;
-  fe_Object **tail = &res;
-  while (!isnil(lst)) {
-    *tail = fe_cons(ctx, eval(ctx, fe_nextarg(ctx, &lst), env, NULL), &nil);
-    tail = &cdr(*tail);
+
+static fe_Object* makeclosure(fe_Context *ctx, fe_Object *code, fe_Object *caps, fe_Object **slots, int type) {
+  Proto *p = proto(code);
+  fe_Object *lst = &nil, *box, *res;
+  int i, j, gc = fe_savegc(ctx);
+  for (i = p->ncaps; i--;) {
+    j = protocaps(p)[i] >> 2;
+    switch (protocaps(p)[i] & 3) {
+      case 0: for (box = caps; j--; box = cdr(box)); box = car(box); break;
+      case 1: box = slots[j]; break;
+      default: box = fe_cons(ctx, slots[j], &nil); break;
+    }
+    lst = fe_cons(ctx, box, lst);
+    fe_restoregc(ctx, gc);
+    fe_pushgc(ctx, lst);
   }
+  lst = fe_cons(ctx, lst, code);
+  res = object(ctx);
+  settype(res, type);
+  cdr(res) = lst;
+  fe_restoregc(ctx, gc);
+  fe_pushgc(ctx, res);
   return res;
 }
 
 
-static fe_Object* dolist(fe_Context *ctx, fe_Object *lst, fe_Object *env) {
-  fe_Object *res = &nil;
-  int save = fe_savegc(ctx);
-  while (!isnil(lst)) {
-    fe_restoregc(ctx, save);
-    fe_pushgc(ctx, lst);
-    fe_pushgc(ctx, env);
-    res = eval(ctx, fe_nextarg(ctx, &lst), env, &env);
+static fe_Object* vmrun(fe_Context *ctx, VM *vm, int level);
+
+
+static fe_Object* apply(fe_Context *ctx, fe_Object *fn, fe_Object **argv, int n) {
+  fe_Object *arg = &nil, *va, *vb, *res;
+  int gc = fe_savegc(ctx), caller = -1;
+  if (type(fn) == FE_TCFUNC && isargv(fn)) {
+    /* the arguments are passed where they are */
+    callenter(ctx, &caller, fn);
+    res = cfuncv(fn)(ctx, n, argv);
+    callleave(ctx, caller);
+    return res;
+  }
+  while (n--) {
+    arg = fe_cons(ctx, argv[n], arg);
+    fe_restoregc(ctx, gc);
+    fe_pushgc(ctx, arg);
+  }
+  switch (type(fn)) {
+    case FE_TCFUNC:
+      callenter(ctx, &caller, fn);
+      res = cfunc(fn)(ctx, arg);
+      callleave(ctx, caller);
+      return res;
+
+    case FE_TFUNC:
+      va = cdr(fn); /* (env params ...) */
+      vb = cdr(va); /* (params ...) */
+      if (type(vb) == T_CODE) { return vmcall(ctx, fn, arg); }
+      callenter(ctx, &caller, vb);
+      res = dolist(ctx, cdr(vb), argstoenv(ctx, car(vb), arg, car(va), 1));
+      callleave(ctx, caller);
+      return res;
+
+    case FE_TPRIM:
+      /* build and evaluate the call with each argument quoted */
+      va = object(ctx);
+      settype(va, FE_TPRIM);
+      prim(va) = P_QUOTE;
+      gc = fe_savegc(ctx);
+      for (vb = arg; !isnil(vb); vb = cdr(vb)) {
+        store(ctx, &car(vb), fe_cons(ctx, va, fe_cons(ctx, car(vb), &nil)));
+        fe_restoregc(ctx, gc);
+      }
+      return eval(ctx, fe_cons(ctx, fn, arg), &nil, NULL);
+
+    case FE_TMACRO:
+      fe_error(ctx, "tried to call macro as a function");
+      break;
+
+    default:
+      fe_error(ctx, "tried to call non-callable value");
   }
-  return res;
+  return NULL;
 }
 
 
-static fe_Object* argstoenv(fe_Context *ctx, fe_Object *prm, fe_Object *arg, fe_Object *env) {
-  while (!isnil(prm)) {
-    if (type(prm) != FE_TPAIR) {
-      env = fe_cons(ctx, fe_cons(ctx, prm, arg), env);
-      break;
-    }
-    env = fe_cons(ctx, fe_cons(ctx, car(prm), fe_car(ctx, arg)), env);
-    prm = cdr(prm);
-    arg = fe_cdr(ctx, arg);
+static fe_Object* vmcall(fe_Context *ctx, fe_Object *fn, fe_Object *args) {
+  VM *vm = getvm(ctx);
+  int n, level = vm->nframes, base = vm->sp + 1;
+  if (base > VMSTACKSIZE) { fe_error(ctx, "stack overflow"); }
+  vm->stack[base - 1] = fn;
+  for (n = 0; type(args) == FE_TPAIR; args = cdr(args), n++) {
+    if (base + n == VMSTACKSIZE) { fe_error(ctx, "stack overflow"); }
+    vm->stack[base + n] = car(args);
   }
-  return env;
+  vmenter(ctx, vm, base, n, 0);
+  return vmrun(ctx, vm, level);
 }
 
 
-#define evalarg() eval(ctx, fe_nextarg(ctx, &arg), env, NULL)
-
-#define arithop(op) {                             \
-    fe_Number x = fe_tonumber(ctx, evalarg());    \
-    while (!isnil(arg)) {                         \
-      x = x op fe_tonumber(ctx, evalarg());       \
-    }                                             \
-    res = fe_number(ctx, x);                      \
+static fe_Object* stackcall(fe_Context *ctx, fe_Object *fn, fe_Object *arg, fe_Object *env) {
+  /* evaluates the arguments of a call to a compiled closure or an argv
+  ** cfunc straight onto the vm's stack, so no argument list is made */
+  VM *vm = getvm(ctx);
+  fe_Object *res;
+  int n, level = vm->nframes, base = vm->sp + 1, gc = fe_savegc(ctx);
+  if (base > VMSTACKSIZE) { fe_error(ctx, "stack overflow"); }
+  vm->stack[base - 1] = fn;
+  vm->sp = base;
+  for (n = 0; !isnil(arg); n++) {
+    res = eval(ctx, fe_nextarg(ctx, &arg), env, NULL);
+    if (base + n == VMSTACKSIZE) { fe_error(ctx, "stack overflow"); }
+    vm->stack[vm->sp++] = res;
+    fe_restoregc(ctx, gc);
   }
-
-#define numcmpop(op) {                            \
-    va = checktype(ctx, evalarg(), FE_TNUMBER);   \
-    vb = checktype(ctx, evalarg(), FE_TNUMBER);   \
-    res = fe_bool(ctx, number(va) op number(vb)); \
+  if (type(fn) == FE_TCFUNC) {
+    res = cfuncv(fn)(ctx, n, &vm->stack[base]);
+    vm->sp = base - 1;
+    return res;
   }
+  vmenter(ctx, vm, base, n, 0);
+  return vmrun(ctx, vm, level);
+}
 
 
-static fe_Object* eval(fe_Context *ctx, fe_Object *obj, fe_Object *env, fe_Object **newenv) {
-  fe_Object *fn, *arg, *res;
-  fe_Object cl, *va, *vb;
-  int n, gc;
-
-  if (type(obj) == FE_TSYMBOL) { return cdr(getbound(obj, env)); }
-  if (type(obj) != FE_TPAIR) { return obj; }
+/* A coroutine runs on the vm's stack above whatever resumed it, its frames
+** being those from the vm's frame count at the time up. Yielding moves these
+** frames, and the part of the stack they use, into the coroutine and returns
+** from the vmrun() its resume started; resuming copies them back onto the
+** top of the stack. A suspended coroutine thus holds no C stack and no more
+** memory than its frames use. Only compiled code can yield, and only when
+** no cfunc or evaluated code is running between it and its resume */
 
-  car(&cl) = obj, cdr(&cl) = ctx->calllist;
-  ctx->calllist = &cl;
+fe_Object* fe_coroutine(fe_Context *ctx, fe_Object *fn) {
+  fe_Object *obj;
+  Coro *c;
+  checktype(ctx, fn, FE_TFUNC);
+  obj = object(ctx);
+  settype(obj, FE_TCOROUTINE);
+  costate(obj) = FE_CSUSPENDED;
+  bytes(obj) = NULL;
+  c = bytes(obj) = allocbytes(ctx, sizeof(Coro));
+  c->fn = fn;
+  c->resumer = NULL;
+  c->level = -1;
+  c->depth = c->prof = c->nframes = c->nstack = 0;
+  return obj;
+}
 
-  gc = fe_savegc(ctx);
-  fn = eval(ctx, car(obj), env, NULL);
-  arg = cdr(obj);
-  res = &nil;
 
-  switch (type(fn)) {
-    case FE_TPRIM:
-      switch (prim(fn)) {
-        case P_LET:
-          va = checktype(ctx, fe_nextarg(ctx, &arg), FE_TSYMBOL);
-          if (newenv) {
-            *newenv = fe_cons(ctx, fe_cons(ctx, va, evalarg()), env);
-          }
-          break;
+int fe_costatus(fe_Context *ctx, fe_Object *co) {
+  return costate(checktype(ctx, co, FE_TCOROUTINE));
+}
 
-        case P_SET:
-          va = checktype(ctx, fe_nextarg(ctx, &arg), FE_TSYMBOL);
-          cdr(getbound(va, env)) = evalarg();
-          break;
 
-        case P_IF:
-          while (!isnil(arg)) {
-            va = evalarg();
-            if (!isnil(va)) {
-              res = isnil(arg) ? va : evalarg();
-              break;
-            }
-            if (isnil(arg)) { break; }
-            arg = cdr(arg);
-          }
-          break;
+static void restore(fe_Context *ctx, VM *vm, Coro *c, int start) {
+  /* copies a suspended coroutine's frames and stack back onto the vm at
+  ** `start`; as the coroutine stops holding them they're shaded, as a store
+  ** would */
+  Frame *f = &vm->frames[vm->nframes];
+  Proto *p;
+  int i, top = start + coframes(c)[c->nframes - 1].base;
+  p = proto(cdr(cdr(costack(c)[top - start - 1])));
+  if (vm->nframes + c->nframes > VMFRAMES ||
+      top + p->nslots + p->maxstack > VMSTACKSIZE
+  ) {
+    fe_error(ctx, "stack overflow");
+  }
+  memcpy(&vm->stack[start], costack(c), c->nstack * sizeof(fe_Object*));
+  for (i = 0; i < c->nframes; i++) {
+    f[i] = coframes(c)[i];
+    f[i].base += start;
+    if (f[i].prof >= ctx->profcount) { f[i].prof = ctx->profcur; }
+  }
+  /* the bottom frame returns to wherever this resume was called from */
+  f[0].prof = ctx->profcur;
+  if (c->prof < ctx->profcount) { ctx->profcur = c->prof; }
+  if (ctx->gcstate == GC_MARK) {
+    for (i = 0; i < c->nstack; i++) { shade(ctx, costack(c)[i]); }
+  }
+  vm->nframes += c->nframes;
+  vm->sp = start + c->nstack;
+  if ((ctx->calldepth += c->nframes) > ctx->calldepth_max) {
+    ctx->calldepth_max = ctx->calldepth;
+  }
+  c->nframes = c->nstack = 0;
+}
 
-        case P_FN: case P_MAC:
-          va = fe_cons(ctx, env, arg);
-          fe_nextarg(ctx, &arg);
-          res = object(ctx);
-          settype(res, prim(fn) == P_FN ? FE_TFUNC : FE_TMACRO);
-          cdr(res) = va;
-          break;
 
-        case P_WHILE:
-          va = fe_nextarg(ctx, &arg);
-          n = fe_savegc(ctx);
-          while (!isnil(eval(ctx, va, env, NULL))) {
-            dolist(ctx, arg, env);
-            fe_restoregc(ctx, n);
-          }
-          break;
+static void suspend(fe_Context *ctx, VM *vm, int level) {
+  /* moves the running coroutine's frames and stack off the vm; called by
+  ** the vmrun() at `level`, which then returns to the resume */
+  fe_Object *co = ctx->co;
+  Coro *c;
+  int i, start, nframes, nstack;
+  size_t size;
+  if (!co) { fe_error(ctx, "yield outside of a coroutine"); }
+  if (coro(co)->level != level) { fe_error(ctx, "cannot yield across a C call"); }
+  start = vm->frames[level].base - 1;
+  nframes = vm->nframes - level;
+  nstack = vm->sp - start;
+  size = sizeof(Coro) + nframes * sizeof(Frame) + nstack * sizeof(fe_Object*);
+  if (bytessize(coro(co)) < size) {
+    c = allocbytes(ctx, size);
+    *c = *coro(co);
+    freebytes(ctx, coro(co));
+    bytes(co) = c;
+  }
+  c = coro(co);
+  c->nframes = nframes;
+  c->nstack = nstack;
+  for (i = 0; i < nframes; i++) {
+    coframes(c)[i] = vm->frames[level + i];
+    coframes(c)[i].base -= start;
+  }
+  memcpy(costack(c), &vm->stack[start], nstack * sizeof(fe_Object*));
+  c->prof = ctx->profcur;
+  ctx->profcur = vm->frames[level].prof;
+  ctx->calldepth -= nframes;
+  vm->nframes = level;
+  vm->sp = start;
+  costate(co) = FE_CSUSPENDED;
+}
 
-        case P_QUOTE:
-          res = fe_nextarg(ctx, &arg);
-          break;
 
-        case P_AND:
-          while (!isnil(arg) && !isnil(res = evalarg()));
-          break;
+fe_Object* fe_resume(fe_Context *ctx, fe_Object *co, fe_Object *v) {
+  VM *vm = getvm(ctx);
+  fe_Object *fn, *res;
+  Coro *c;
+  int level = vm->nframes, start = vm->sp, gc = fe_savegc(ctx);
+  checktype(ctx, co, FE_TCOROUTINE);
+  if (costate(co) != FE_CSUSPENDED) {
+    fe_error(ctx, costate(co) == FE_CDEAD ? "cannot resume dead coroutine" :
+                                            "cannot resume running coroutine");
+  }
+  fe_pushgc(ctx, co);
+  c = coro(co);
+  costate(co) = FE_CRUNNING;
+  c->resumer = ctx->co;
+  c->level = level;
+  c->depth = ctx->calldepth;
+  ctx->co = co;
+  fn = c->fn;
+  if (!fn) {
+    /* `v` is the result of the yield it was suspended at */
+    restore(ctx, vm, c, start);
+    vm->stack[vm->sp++] = v;
+    res = vmrun(ctx, vm, level);
+  } else {
+    /* `v` is the fn's argument */
+    fe_mark(ctx, fn);
+    fe_pushgc(ctx, fn);
+    c->fn = NULL;
+    if (iscompiled(fn)) {
+      if (start + 2 > VMSTACKSIZE) { fe_error(ctx, "stack overflow"); }
+      vm->stack[start] = fn;
+      vm->stack[start + 1] = v;
+      vmenter(ctx, vm, start + 1, 1, 0);
+      res = vmrun(ctx, vm, level);
+    } else {
+      c->level = -1;
+      res = apply(ctx, fn, &v, 1);
+    }
+  }
+  /* yielding may have moved the coroutine's state */
+  c = coro(co);
+  ctx->co = c->resumer;
+  c->resumer = NULL;
+  if (costate(co) == FE_CRUNNING) {
+    /* it returned, so there's nothing left to keep */
+    costate(co) = FE_CDEAD;
+    freebytes(ctx, c);
+    bytes(co) = NULL;
+  }
+  fe_restoregc(ctx, gc);
+  fe_pushgc(ctx, res);
+  return res;
+}
 
-        case P_OR:
-          while (!isnil(arg) && isnil(res = evalarg()));
-          break;
 
-        case P_DO:
-          res = dolist(ctx, arg, env);
-          break;
+fe_Object* fe_yield(fe_Context *ctx, fe_Object *v) {
+  /* a cfunc yields by returning this; as every frame and cfunc call counts
+  ** towards the call depth, it only matches if the cfunc was called by the
+  ** coroutine's topmost frame, which suspends once the cfunc returns */
+  VM *vm;
+  Coro *c;
+  if (!ctx->co) { fe_error(ctx, "yield outside of a coroutine"); }
+  vm = bytes(ctx->vm);
+  c = coro(ctx->co);
+  if (c->level < 0 || ctx->calldepth != c->depth + vm->nframes - c->level + 1) {
+    fe_error(ctx, "cannot yield across a C call");
+  }
+  ctx->yielding = 1;
+  return v;
+}
 
-        case P_CONS:
-          va = evalarg();
-          res = fe_cons(ctx, va, evalarg());
-          break;
 
-        case P_CAR:
-          res = fe_car(ctx, evalarg());
-          break;
+#define vmarg()       ( pc += 2, pc[-2] | pc[-1] << 8 )
 
-        case P_CDR:
-          res = fe_cdr(ctx, evalarg());
-          break;
+#define vmload() {                                  \
+    Frame *f = &vm->frames[vm->nframes - 1];        \
+    fe_Object *fn = stack[f->base - 1];             \
+    bp = stack + f->base;                           \
+    sp = stack + vm->sp;                            \
+    caps = car(cdr(fn));                            \
+    k = protok(proto(cdr(cdr(fn))));                \
+    code = protocode(proto(cdr(cdr(fn))));          \
+    pc = f->pc;                                     \
+  }
 
-        case P_SETCAR:
-          va = checktype(ctx, evalarg(), FE_TPAIR);
-          car(va) = evalarg();
-          break;
+/* instructions which may allocate or call out first store the stack pointer
+** for the gc; anything on the stack at that point stays marked until the
+** next sync, so they may pop before allocating */
+#define vmsync() {                                  \
+    vm->sp = sp - stack;                            \
+    ctx->gcstack_idx = gc;                          \
+  }
 
-        case P_SETCDR:
-          va = checktype(ctx, evalarg(), FE_TPAIR);
-          cdr(va) = evalarg();
-          break;
+#define vmnumber(x) \
+  ( type(x) == FE_TNUMBER ? number(x) : fe_tonumber(ctx, x) )
+
+#define vmarith(op) {                               \
+    vmsync();                                       \
+    n = vmarg();                                    \
+    x = vmnumber(sp[-n]);                           \
+    for (i = n - 1; i > 0; i--) {                   \
+      x = x op vmnumber(sp[-i]);                    \
+    }                                               \
+    sp -= n;                                        \
+    *sp++ = fe_number(ctx, x);                      \
+  }
 
-        case P_LIST:
-          res = evallist(ctx, arg, env);
-          break;
+#define vmnumcmp(op) {                              \
+    a = checktype(ctx, sp[-2], FE_TNUMBER);         \
+    b = checktype(ctx, sp[-1], FE_TNUMBER);         \
+    sp--;                                           \
+    sp[-1] = fe_bool(ctx, number(a) op number(b));  \
+  }
 
-        case P_NOT:
-          res = fe_bool(ctx, isnil(evalarg()));
-          break;
+#define vmcmpjmp(op) {                              \
+    a = checktype(ctx, sp[-2], FE_TNUMBER);         \
+    b = checktype(ctx, sp[-1], FE_TNUMBER);         \
+    sp -= 2;                                        \
+    n = vmarg();                                    \
+    if (!(number(a) op number(b))) {                \
+      pc = code + n;                                \
+    }                                               \
+  }
 
-        case P_IS:
-          va = evalarg();
-          res = fe_bool(ctx, equal(va, evalarg()));
-          break;
 
-        case P_ATOM:
-          res = fe_bool(ctx, fe_type(ctx, evalarg()) != FE_TPAIR);
-          break;
+static fe_Object* vmrun(fe_Context *ctx, VM *vm, int level) {
+  /* runs until the frame entered at `level` returns */
+  fe_Object **stack = vm->stack, **sp, **bp, **k, *caps, *a, *b;
+  unsigned char *pc, *code;
+  fe_Number x;
+  int i, n, gc = fe_savegc(ctx);
 
-        case P_PRINT:
-          while (!isnil(arg)) {
-            fe_writefp(ctx, evalarg(), stdout);
-            if (!isnil(arg)) { printf(" "); }
+  vmload();
+  for (;;) {
+    switch (*pc++) {
+      case OP_NIL: *sp++ = &nil; break;
+      case OP_CONST: *sp++ = k[vmarg()]; break;
+      case OP_LOCAL: *sp++ = bp[vmarg()]; break;
+      case OP_SETLOCAL: bp[vmarg()] = *--sp; break;
+      case OP_BOXED: *sp++ = car(bp[vmarg()]); break;
+      case OP_SETBOXED: n = vmarg(); store(ctx, &car(bp[n]), *--sp); break;
+      case OP_BOX:
+        vmsync();
+        n = vmarg();
+        bp[n] = fe_cons(ctx, bp[n], &nil);
+        break;
+
+      case OP_MKBOX:
+        vmsync();
+        n = vmarg();
+        bp[n] = fe_cons(ctx, *--sp, &nil);
+        break;
+
+      case OP_UPVAL: case OP_SETUPVAL:
+        for (a = caps, n = vmarg(); n--; a = cdr(a));
+        if (pc[-3] == OP_UPVAL) { *sp++ = car(car(a)); }
+        else { store(ctx, &car(car(a)), *--sp); }
+        break;
+
+      case OP_GLOBAL: *sp++ = cdr(cdr(k[vmarg()])); break;
+      case OP_SETGLOBAL: n = vmarg(); store(ctx, &cdr(cdr(k[n])), *--sp); break;
+      case OP_POP: sp--; break;
+      case OP_JMP: pc = code + vmarg(); break;
+
+      case OP_JMPNIL:
+        n = vmarg();
+        if (isnil(*--sp)) { pc = code + n; }
+        break;
+
+      case OP_ANDJMP: case OP_ORJMP:
+        i = pc[-1] == OP_ORJMP;
+        n = vmarg();
+        if (isnil(sp[-1]) != i) { pc = code + n; } else { sp--; }
+        break;
+
+      case OP_CLOSURE: case OP_MACRO:
+        vmsync();
+        i = pc[-1] == OP_CLOSURE ? FE_TFUNC : FE_TMACRO;
+        a = k[vmarg()];
+        *sp++ = makeclosure(ctx, a, caps, bp, i);
+        break;
+
+      case OP_CALL: case OP_TAILCALL:
+        vmsync();
+        i = pc[-1] == OP_TAILCALL;
+        n = vmarg();
+        a = sp[-n - 1];
+        if (type(a) == FE_TFUNC && iscompiled(a)) {
+          if (i) {
+            memmove(bp - 1, sp - n - 1, (n + 1) * sizeof(fe_Object*));
+            vmenter(ctx, vm, bp - stack, n, 1);
+          } else {
+            /* a call given exactly its fn's parameters, for a fn without
+            ** `let`s, only needs a frame pushed while not profiling. That is
+            ** done here to save vmenter() and the vmload() after it; a
+            ** frame's pc is stored whenever it calls or yields, so is left
+            ** unset */
+            Proto *p = proto(cdr(cdr(a)));
+            Frame *f;
+            vm->frames[vm->nframes - 1].pc = pc;
+            if (n == p->nparams && n == p->nslots && !p->rest && !ctx->prof &&
+                vm->nframes < VMFRAMES &&
+                sp - stack + p->maxstack <= VMSTACKSIZE
+            ) {
+              f = &vm->frames[vm->nframes++];
+              f->base = sp - stack - n;
+              f->prof = ctx->profcur;
+              if (++ctx->calldepth > ctx->calldepth_max) {
+                ctx->calldepth_max = ctx->calldepth;
+              }
+              bp = sp - n;
+              caps = car(cdr(a));
+              k = protok(p);
+              pc = code = protocode(p);
+              break;
+            }
+            vmenter(ctx, vm, sp - stack - n, n, 0);
           }
-          printf("\n");
+          vmload();
           break;
-
-        case P_LT: numcmpop(<); break;
-        case P_LTE: numcmpop(<=); break;
-        case P_ADD: arithop(+); break;
-        case P_SUB: arithop(-); break;
-        case P_MUL: arithop(*); break;
-        case P_DIV: arithop(/); break;
-      }
-      break;
-
-    case FE_TCFUNC:
-      res = cfunc(fn)(ctx, evallist(ctx, arg, env));
-      break;
-
-    case FE_TFUNC:
-      arg = evallist(ctx, arg, env);
-      va = cdr(fn); /* (env params ...) */
-      vb = cdr(va); /* (params ...) */
-      res = dolist(ctx, cdr(vb), argstoenv(ctx, car(vb), arg, car(va)));
-      break;
-
-    case FE_TMACRO:
-      va = cdr(fn); /* (env params ...) */
-      vb = cdr(va); /* (params ...) */
-      /* replace caller object with code generated by macro and re-eval */
-      *obj = *dolist(ctx, cdr(vb), argstoenv(ctx, car(vb), arg, car(va)));
-      fe_restoregc(ctx, gc);
-      ctx->calllist = cdr(&cl);
-      return eval(ctx, obj, env, NULL);
-
-    default:
-      fe_error(ctx, "tried to call non-callable value");
+        }
+        a = apply(ctx, a, sp - n, n);
+        sp -= n;
+        sp[-1] = a;
+        if (ctx->yielding) {
+          /* a tail call is always followed by a return, so once resumed
+          ** this carries on as for any other call */
+          ctx->yielding = 0;
+          sp--;
+          goto yield;
+        }
+        if (!i) { break; }
+        /* fall through */
+
+      case OP_RET:
+        a = sp[-1];
+        vm->sp = bp - stack - 1;
+        callleave(ctx, vm->frames[vm->nframes - 1].prof);
+        if (--vm->nframes == level) {
+          fe_restoregc(ctx, gc);
+          fe_pushgc(ctx, a);
+          return a;
+        }
+        stack[vm->sp++] = a;
+        vmload();
+        break;
+
+      case OP_CONS:
+        vmsync();
+        sp--;
+        sp[-1] = fe_cons(ctx, sp[-1], sp[0]);
+        break;
+
+      case OP_CAR: sp[-1] = fe_car(ctx, sp[-1]); break;
+      case OP_CDR: sp[-1] = fe_cdr(ctx, sp[-1]); break;
+
+      case OP_SETCAR: case OP_SETCDR:
+        a = checktype(ctx, sp[-2], FE_TPAIR);
+        if (pc[-1] == OP_SETCAR) { store(ctx, &car(a), sp[-1]); }
+        else { store(ctx, &cdr(a), sp[-1]); }
+        sp--;
+        sp[-1] = &nil;
+        break;
+
+      case OP_LIST:
+        vmsync();
+        a = &nil;
+        for (n = vmarg(), i = 1; i <= n; i++) {
+          a = fe_cons(ctx, sp[-i], a);
+          fe_restoregc(ctx, gc);
+          fe_pushgc(ctx, a);
+        }
+        sp -= n;
+        *sp++ = a;
+        break;
+
+      case OP_NOT: sp[-1] = fe_bool(ctx, isnil(sp[-1])); break;
+      case OP_IS: sp--; sp[-1] = fe_bool(ctx, equal(sp[-1], sp[0])); break;
+      case OP_ATOM: sp[-1] = fe_bool(ctx, type(sp[-1]) != FE_TPAIR); break;
+
+      case OP_PRINT:
+        fe_writefp(ctx, *--sp, stdout);
+        if (vmarg()) { fputc(' ', stdout); }
+        break;
+
+      case OP_PRINTEND: fputc('\n', stdout); *sp++ = &nil; break;
+      case OP_JMPNLT: vmcmpjmp(<); break;
+      case OP_JMPNLTE: vmcmpjmp(<=); break;
+      case OP_LT: vmnumcmp(<); break;
+      case OP_LTE: vmnumcmp(<=); break;
+      case OP_ADD: vmarith(+); break;
+      case OP_SUB: vmarith(-); break;
+      case OP_MUL: vmarith(*); break;
+      case OP_DIV: vmarith(/); break;
+
+      case OP_VECTOR:
+        vmsync();
+        n = vmarg();
+        a = makevector(ctx, n, &nil);
+        memcpy(vecitems(a), sp - n, n * sizeof(fe_Object*));
+        sp -= n;
+        *sp++ = a;
+        break;
+
+      case OP_MAKEVEC:
+        vmsync();
+        sp--;
+        sp[-1] = newvector(ctx, sp[-1], sp[0]);
+        break;
+
+      case OP_VECGET:
+        sp--;
+        sp[-1] = *vecslot(ctx, sp[-1], vmnumber(sp[0]));
+        break;
+
+      case OP_VECSET:
+        sp -= 2;
+        store(ctx, vecslot(ctx, sp[-1], vmnumber(sp[0])), sp[1]);
+        sp[-1] = &nil;
+        break;
+
+      case OP_VECLEN:
+        vmsync();
+        sp[-1] = fe_number(ctx, fe_veclen(ctx, sp[-1]));
+        break;
+
+      case OP_TOVEC: case OP_TOLIST:
+        vmsync();
+        if (pc[-1] == OP_TOVEC) { sp[-1] = listtovector(ctx, sp[-1]); }
+        else { sp[-1] = tolist(ctx, sp[-1]); }
+        break;
+
+      case OP_TABLE:
+        vmsync();
+        n = vmarg();
+        a = fe_table(ctx);
+        for (i = n; i > 0; i -= 2) { fe_tabset(ctx, a, sp[-i], sp[1 - i]); }
+        sp -= n;
+        *sp++ = a;
+        break;
+
+      case OP_TABGET:
+        sp--;
+        a = fe_tabget(ctx, sp[-1], sp[0]);
+        sp[-1] = a ? a : &nil;
+        break;
+
+      case OP_TABSET:
+        vmsync();
+        sp -= 2;
+        fe_tabset(ctx, sp[-1], sp[0], sp[1]);
+        sp[-1] = &nil;
+        break;
+
+      case OP_TABDEL:
+        sp--;
+        fe_tabdel(ctx, sp[-1], sp[0]);
+        sp[-1] = &nil;
+        break;
+
+      case OP_TABLEN: case OP_TABKEYS:
+        vmsync();
+        if (pc[-1] == OP_TABLEN) { sp[-1] = fe_number(ctx, fe_tablen(ctx, sp[-1])); }
+        else { sp[-1] = tabkeys(ctx, sp[-1]); }
+        break;
+
+      case OP_MAKEARR:
+        vmsync();
+        sp--;
+        sp[-1] = newarray(ctx, sp[-1], sp[0]);
+        break;
+
+      case OP_TOARR:
+        vmsync();
+        sp[-1] = toarray(ctx, sp[-1]);
+        break;
+
+      case OP_ARRGET:
+        vmsync();
+        sp--;
+        sp[-1] = fe_number(ctx, *arrslot(ctx, sp[-1], vmnumber(sp[0])));
+        break;
+
+      case OP_ARRSET:
+        sp -= 2;
+        *arrslot(ctx, sp[-1], vmnumber(sp[0])) = vmnumber(sp[1]);
+        sp[-1] = &nil;
+        break;
+
+      case OP_ARRLEN:
+        vmsync();
+        sp[-1] = fe_number(ctx, fe_arrlen(ctx, sp[-1]));
+        break;
+
+      case OP_ARROP:
+        vmsync();
+        i = vmarg();
+        n = arrargs[i - P_ARRFILL];
+        a = arrayop(ctx, i, sp - n);
+        sp -= n;
+        *sp++ = a;
+        break;
+
+      case OP_COROUTINE:
+        vmsync();
+        sp[-1] = fe_coroutine(ctx, sp[-1]);
+        break;
+
+      case OP_RESUME:
+        vmsync();
+        sp--;
+        sp[-1] = fe_resume(ctx, sp[-1], sp[0]);
+        break;
+
+      case OP_COSTATUS:
+        vmsync();
+        sp[-1] = fe_symbol(ctx, costatenames[fe_costatus(ctx, sp[-1])]);
+        break;
+
+      case OP_YIELD:
+        a = *--sp;
+      yield:
+        vm->frames[vm->nframes - 1].pc = pc;
+        vm->sp = sp - stack;
+        fe_restoregc(ctx, gc);
+        fe_pushgc(ctx, a);
+        suspend(ctx, vm, level);
+        return a;
+    }
   }
+}
 
+
+fe_Object* fe_compile(fe_Context *ctx, fe_Object *obj) {
+  Compiler c;
+  fe_Object *res;
+  int gc = fe_savegc(ctx);
+  initcompiler(&c, ctx, NULL);
+  compile(&c, obj, 1);
+  emit(&c, OP_RET, -1);
+  obj = fe_cons(ctx, &nil, finish(&c));
+  res = object(ctx);
+  settype(res, FE_TFUNC);
+  cdr(res) = obj;
   fe_restoregc(ctx, gc);
   fe_pushgc(ctx, res);
-  ctx->calllist = cdr(&cl);
   return res;
 }
 
 
-fe_Object* fe_eval(fe_Context *ctx, fe_Object *obj) {
-  return eval(ctx, obj, &nil, NULL);
+fe_Object* fe_run(fe_Context *ctx, fe_Object *fn) {
+  return apply(ctx, fn, NULL, 0);
 }
 
 
+
 fe_Context* fe_open(void *ptr, int size) {
   int i, save;
   fe_Context *ctx;
@@ -791,21 +4753,28 @@ fe_Context* fe_open(void *ptr, int size) {
   ptr = (char*) ptr + sizeof(fe_Context);
   size -= sizeof(fe_Context);
 
-  /* init objects memory region */
-  ctx->objects = (fe_Object*) ptr;
-  ctx->object_count = size / sizeof(fe_Object);
-
-  /* init lists */
+  /* init symbol table; one bucket per ~16 objects keeps chains short */
+  ctx->symtab = (fe_Object**) ptr;
+  ctx->symtab_size = 1;
+  while (ctx->symtab_size * 16 < size / (int) sizeof(fe_Object)) {
+    ctx->symtab_size <<= 1;
+  }
+  ptr = (char*) ptr + ctx->symtab_size * sizeof(fe_Object*);
+  size -= ctx->symtab_size * sizeof(fe_Object*);
+
+  /* the rest of the region is the first arena */
+  ctx->arenas = initarena(ptr, size);
+  ctx->gcwait = capacity(ctx) * 3 / 4;
+
+  /* init lists and stacks */
+  ctx->gcstack = ctx->gcstackinit;
+  ctx->gcstack_cap = GCSTACKSIZE;
+  ctx->gray = ctx->grayinit;
+  ctx->graycap = GRAYSTACKSIZE;
   ctx->calllist = &nil;
   ctx->freelist = &nil;
-  ctx->symlist = &nil;
-
-  /* populate freelist */
-  for (i = 0; i < ctx->object_count; i++) {
-    fe_Object *obj = &ctx->objects[i];
-    settype(obj, FE_TFREE);
-    cdr(obj) = ctx->freelist;
-    ctx->freelist = obj;
+  for (i = 0; i < ctx->symtab_size; i++) {
+    ctx->symtab[i] = &nil;
   }
 
   /* init objects */
@@ -826,11 +4795,310 @@ fe_Context* fe_open(void *ptr, int size) {
 }
 
 
+fe_Context* fe_openalloc(fe_AllocFn fn, void *udata, int size) {
+  fe_Context *ctx;
+  void *ptr = fn(udata, NULL, size);
+  if (!ptr) { return NULL; }
+  ctx = fe_open(ptr, size);
+  ctx->alloc = fn;
+  ctx->udata = udata;
+  return ctx;
+}
+
+
 void fe_close(fe_Context *ctx) {
-  /* clear gcstack and symlist; makes all objects unreachable */
+  int i;
+  /* clear gcstack, symtab and vm; makes all objects unreachable */
   ctx->gcstack_idx = 0;
-  ctx->symlist = &nil;
+  ctx->vm = NULL;
+  for (i = 0; i < ctx->symtab_size; i++) {
+    ctx->symtab[i] = &nil;
+  }
   collectgarbage(ctx);
+  /* free added arenas, then the region itself if the allocator made it */
+  if (ctx->alloc) {
+    Arena *a, *next;
+    for (a = ctx->arenas->next; a; a = next) {
+      next = a->next;
+      ctx->alloc(ctx->udata, a, 0);
+    }
+    ctx->alloc(ctx->udata, ctx, 0);
+  }
+}
+
+
+/* An image is a context's region saved as is after a header, followed by
+** the binding table it was saved with. Loading it fixes up every pointer in
+** place: those into the region are moved by the distance it has moved,
+** those to nil are pointed at this program's nil, and cfuncs and ptrs are
+** re-bound by name. Only a context which has not grown can be saved, and
+** only when nothing is running */
+
+#define IMAGEHEADER  ( 64 )
+#define IMAGEVERSION ( 11 )
+
+typedef struct {
+  char magic[8];
+  int version, ptrsize, numsize, ctxsize, size, nbindings;
+  size_t base, nil;
+} Image;
+
+typedef struct {
+  size_t base, size, nil;
+  char *ptr;
+  int bad;
+} Reloc;
+
+
+static int isbinding(const fe_Binding *b, fe_Object *obj) {
+  if (type(obj) != FE_TCFUNC) { return b->ptr == obj->cdr.p; }
+  return isargv(obj) ? b->fnv == cfuncv(obj) : b->fn == cfunc(obj);
+}
+
+
+static int findbinding(const fe_Binding *b, fe_Object *obj) {
+  int i;
+  for (i = 0; b && b[i].name; i++) {
+    if (isbinding(&b[i], obj)) { return i; }
+  }
+  return -1;
+}
+
+
+void fe_saveimage(fe_Context *ctx, const fe_Binding *bindings, fe_WriteBlockFn fn, void *udata) {
+  char hdr[IMAGEHEADER];
+  Image img;
+  Arena *a = ctx->arenas;
+  int i;
+  if (a->next || ctx->calldepth) { fe_error(ctx, "cannot save context"); }
+  finishgc(ctx);
+  for (i = 0; i < a->object_count; i++) {
+    fe_Object *obj = &a->objects[i];
+    if (ishole(a, i)) { continue; }
+    if ((type(obj) == FE_TCFUNC || (type(obj) == FE_TPTR && cdr(obj))) &&
+        findbinding(bindings, obj) < 0
+    ) {
+      fe_error(ctx, "cannot save unbound cfunc or ptr");
+    }
+  }
+  memset(&img, 0, sizeof(img));
+  memcpy(img.magic, "feimage", 8);
+  img.version = IMAGEVERSION;
+  img.ptrsize = sizeof(void*);
+  img.numsize = sizeof(fe_Number);
+  img.ctxsize = sizeof(fe_Context);
+  img.size = a->end - (char*) ctx;
+  img.base = (size_t) ctx;
+  img.nil = (size_t) &nil;
+  for (img.nbindings = 0; bindings && bindings[img.nbindings].name;) {
+    img.nbindings++;
+  }
+  memset(hdr, 0, sizeof(hdr));
+  memcpy(hdr, &img, sizeof(img));
+  fn(ctx, udata, hdr, sizeof(hdr));
+  fn(ctx, udata, (char*) ctx, img.size);
+  /* each binding is saved as its old addresses followed by its name */
+  for (i = 0; i < img.nbindings; i++) {
+    fn(ctx, udata, (char*) &bindings[i].fn, sizeof(fe_CFunc));
+    fn(ctx, udata, (char*) &bindings[i].ptr, sizeof(void*));
+    fn(ctx, udata, (char*) &bindings[i].fnv, sizeof(fe_CFuncV));
+    fn(ctx, udata, bindings[i].name, strlen(bindings[i].name) + 1);
+  }
+}
+
+
+static void* relocptr(Reloc *r, void *ptr) {
+  size_t p = (size_t) ptr;
+  if (!ptr) { return ptr; }
+  if (p == r->nil) { return &nil; }
+  if (p - r->base < r->size) { return r->ptr + (p - r->base); }
+  r->bad = 1;
+  return NULL;
+}
+
+
+static fe_Object* reloc(Reloc *r, fe_Object *obj) {
+  return isimm(obj) ? obj : relocptr(r, obj);
+}
+
+
+static int checkbindings(const char *recs, int n, size_t left) {
+  /* each saved binding must lie within the `left` bytes after the region,
+  ** its name terminated within them */
+  size_t fixed = sizeof(fe_CFunc) + sizeof(void*) + sizeof(fe_CFuncV);
+  const char *end;
+  if (n < 0) { return 0; }
+  while (n--) {
+    if (left < fixed) { return 0; }
+    recs += fixed;
+    left -= fixed;
+    end = memchr(recs, '\0', left);
+    if (!end) { return 0; }
+    left -= end - recs + 1;
+    recs = end + 1;
+  }
+  return 1;
+}
+
+
+static int rebind(fe_Object *obj, const char *recs, int n, const fe_Binding *b) {
+  /* finds the saved binding with the object's old value, then the binding
+  ** of the same name in the new table */
+  fe_Binding old;
+  int i;
+  while (n--) {
+    memcpy(&old.fn, recs, sizeof(fe_CFunc));
+    recs += sizeof(fe_CFunc);
+    memcpy(&old.ptr, recs, sizeof(void*));
+    recs += sizeof(void*);
+    memcpy(&old.fnv, recs, sizeof(fe_CFuncV));
+    old.name = recs + sizeof(fe_CFuncV);
+    recs = old.name + strlen(old.name) + 1;
+    if (!isbinding(&old, obj)) { continue; }
+    for (i = 0; b && b[i].name; i++) {
+      if (strcmp(b[i].name, old.name)) { continue; }
+      if (type(obj) != FE_TCFUNC) { obj->cdr.p = b[i].ptr; }
+      else if (isargv(obj)) { cfuncv(obj) = b[i].fnv; }
+      else { cfunc(obj) = b[i].fn; }
+      return 1;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+
+fe_Context* fe_openimage(void *ptr, int size, const fe_Binding *bindings) {
+  fe_Context *ctx = (fe_Context*) ((char*) ptr + IMAGEHEADER);
+  const char *recs;
+  Image img;
+  Reloc r;
+  Arena *a;
+  FreeBlock *blk;
+  int i, j;
+
+  /* check the image was saved by a matching build */
+  if (size < IMAGEHEADER) { return NULL; }
+  memcpy(&img, ptr, sizeof(img));
+  if (memcmp(img.magic, "feimage", 8) || img.version != IMAGEVERSION ||
+      img.ptrsize != sizeof(void*) || img.numsize != sizeof(fe_Number) ||
+      img.ctxsize != sizeof(fe_Context) ||
+      img.size < (int) sizeof(fe_Context) || img.size > size - IMAGEHEADER
+  ) {
+    return NULL;
+  }
+  recs = (char*) ctx + img.size;
+  if (!checkbindings(recs, img.nbindings, size - IMAGEHEADER - img.size)) {
+    return NULL;
+  }
+  r.base = img.base;
+  r.size = img.size;
+  r.nil = img.nil;
+  r.ptr = (char*) ctx;
+  r.bad = 0;
+
+  /* reset state which doesn't survive a save, fix the context's pointers */
+  memset(&ctx->handlers, 0, sizeof(ctx->handlers));
+  ctx->alloc = NULL;
+  ctx->udata = NULL;
+  ctx->prof = NULL;
+  ctx->profcap = ctx->profcount = ctx->profcur = 0;
+  ctx->gcarena = NULL;
+  ctx->calllist = &nil;
+  ctx->co = NULL;
+  ctx->yielding = 0;
+  ctx->arenas = relocptr(&r, ctx->arenas);
+  ctx->symtab = relocptr(&r, ctx->symtab);
+  ctx->gcstack = relocptr(&r, ctx->gcstack);
+  ctx->gray = relocptr(&r, ctx->gray);
+  ctx->vm = reloc(&r, ctx->vm);
+  ctx->freelist = reloc(&r, ctx->freelist);
+  ctx->t = reloc(&r, ctx->t);
+  for (i = 0; i < ctx->gcstack_idx; i++) {
+    ctx->gcstack[i] = reloc(&r, ctx->gcstack[i]);
+  }
+  for (i = 0; i < ctx->symtab_size; i++) {
+    ctx->symtab[i] = reloc(&r, ctx->symtab[i]);
+  }
+  for (i = 0; i < BYTESCLASSES; i++) {
+    ctx->bytesfree[i] = relocptr(&r, ctx->bytesfree[i]);
+    for (blk = ctx->bytesfree[i]; blk; blk = blk->next) {
+      blk->next = relocptr(&r, blk->next);
+    }
+  }
+  a = ctx->arenas;
+  a->end = (char*) ctx + img.size;
+  a->marks = relocptr(&r, a->marks);
+  a->holes = relocptr(&r, a->holes);
+  a->objects = relocptr(&r, a->objects);
+  a->bytestop = relocptr(&r, a->bytestop);
+
+  /* fix the objects */
+  for (i = 0; i < a->object_count; i++) {
+    fe_Object *obj = &a->objects[i];
+    if (ishole(a, i)) { continue; }
+    switch (type(obj)) {
+      case FE_TPAIR:
+        car(obj) = reloc(&r, car(obj));
+        /* fall through */
+      case FE_TFREE: case FE_TSYMBOL: case FE_TFUNC: case FE_TMACRO:
+      case T_LOCAL: case T_GLOBAL: case T_LAYOUT: case T_CAPTURES:
+        cdr(obj) = reloc(&r, cdr(obj));
+        break;
+
+      case FE_TSTRING: case FE_TARRAY: case T_BYTES:
+        bytes(obj) = relocptr(&r, bytes(obj));
+        break;
+
+      case FE_TVECTOR:
+        bytes(obj) = relocptr(&r, bytes(obj));
+        for (j = 0; j < length(obj); j++) {
+          vecitems(obj)[j] = reloc(&r, vecitems(obj)[j]);
+        }
+        break;
+
+      case FE_TTABLE:
+        /* keys are hashed by their offset in the region, so stay put */
+        bytes(obj) = relocptr(&r, bytes(obj));
+        for (j = 0; j < tabcap(obj); j++) {
+          tabentries(obj)[j].key = reloc(&r, tabentries(obj)[j].key);
+          tabentries(obj)[j].val = reloc(&r, tabentries(obj)[j].val);
+        }
+        break;
+
+      case T_CODE:
+        bytes(obj) = relocptr(&r, bytes(obj));
+        if (bytes(obj)) {
+          Proto *p = proto(obj);
+          for (j = 0; j < p->nk; j++) { protok(p)[j] = reloc(&r, protok(p)[j]); }
+        }
+        break;
+
+      case FE_TCOROUTINE:
+        bytes(obj) = relocptr(&r, bytes(obj));
+        if (bytes(obj)) {
+          Coro *c = coro(obj);
+          c->fn = relocptr(&r, c->fn);
+          for (j = 0; j < c->nframes; j++) {
+            coframes(c)[j].pc = relocptr(&r, coframes(c)[j].pc);
+          }
+          for (j = 0; j < c->nstack; j++) { costack(c)[j] = reloc(&r, costack(c)[j]); }
+        }
+        break;
+
+      case FE_TCFUNC:
+        if (!rebind(obj, recs, img.nbindings, bindings)) { return NULL; }
+        break;
+
+      case FE_TPTR:
+        if (cdr(obj) && !rebind(obj, recs, img.nbindings, bindings)) {
+          return NULL;
+        }
+        break;
+    }
+  }
+
+  return r.bad ? NULL : ctx;
 }
 
 
@@ -850,10 +5118,17 @@ static void onerror(fe_Context *ctx, const char *msg, fe_Object *cl) {
 
 int main(int argc, char **argv) {
   int gc;
+  volatile int compile = 0;
   fe_Object *obj;
   FILE *volatile fp = stdin;
   fe_Context *ctx = fe_open(buf, sizeof(buf));
 
+  /* `-c` compiles each form to bytecode before running it */
+  if (argc > 1 && !strcmp(argv[1], "-c")) {
+    compile = 1;
+    argc--, argv++;
+  }
+
   /* init input file */
   if (argc > 1) {
     fp = fopen(argv[1], "rb");
@@ -869,7 +5144,7 @@ int main(int argc, char **argv) {
     fe_restoregc(ctx, gc);
     if (fp == stdin) { printf("> "); }
     if (!(obj = fe_readfp(ctx, fp))) { break; }
-    obj = fe_eval(ctx, obj);
+    obj = compile ? fe_run(ctx, fe_compile(ctx, obj)) : fe_eval(ctx, obj);
     if (fp == stdin) { fe_writefp(ctx, obj, stdout); printf("\n"); }
   }
 
@@ -17,19 +17,40 @@ typedef float fe_Number;
 typedef struct fe_Object fe_Object;
 typedef struct fe_Context fe_Context;
 typedef fe_Object* (*fe_CFunc)(fe_Context *ctx, fe_Object *args);
+typedef fe_Object* (*fe_CFuncV)(fe_Context *ctx, int argc, fe_Object **argv);
 typedef void (*fe_ErrorFn)(fe_Context *ctx, const char *err, fe_Object *cl);
 typedef void (*fe_WriteFn)(fe_Context *ctx, void *udata, char chr);
+typedef void (*fe_WriteBlockFn)(fe_Context *ctx, void *udata, const char *data, int len);
 typedef char (*fe_ReadFn)(fe_Context *ctx, void *udata);
-typedef struct { fe_ErrorFn error; fe_CFunc mark, gc; } fe_Handlers;
+typedef void* (*fe_AllocFn)(void *udata, void *ptr, size_t size);
+typedef void (*fe_CycleFn)(fe_Context *ctx, int end);
+typedef struct {
+  fe_ErrorFn error; fe_CFunc mark, gc; fe_CycleFn cycle;
+} fe_Handlers;
+typedef struct { const char *name; fe_CFunc fn; void *ptr; fe_CFuncV fnv; } fe_Binding;
+typedef struct {
+  unsigned long allocs, cycles, gcwork, stalls;
+  int objects, live, live_max;
+  int gcstack, gcstack_max, calldepth, calldepth_max;
+} fe_Stats;
+
+enum { FE_PSAMPLES, FE_PALLOCS, FE_PCALLS };
+
+enum { FE_CSUSPENDED, FE_CRUNNING, FE_CDEAD };
 
 enum {
   FE_TPAIR, FE_TFREE, FE_TNIL, FE_TNUMBER, FE_TSYMBOL, FE_TSTRING,
-  FE_TFUNC, FE_TMACRO, FE_TPRIM, FE_TCFUNC, FE_TPTR
+  FE_TFUNC, FE_TMACRO, FE_TPRIM, FE_TCFUNC, FE_TPTR, FE_TVECTOR,
+  FE_TTABLE, FE_TARRAY, FE_TCOROUTINE
 };
 
 fe_Context* fe_open(void *ptr, int size);
+fe_Context* fe_openalloc(fe_AllocFn fn, void *udata, int size);
 void fe_close(fe_Context *ctx);
+void fe_saveimage(fe_Context *ctx, const fe_Binding *bindings, fe_WriteBlockFn fn, void *udata);
+fe_Context* fe_openimage(void *ptr, int size, const fe_Binding *bindings);
 fe_Handlers* fe_handlers(fe_Context *ctx);
+void fe_stats(fe_Context *ctx, fe_Stats *st);
 void fe_error(fe_Context *ctx, const char *msg);
 fe_Object* fe_nextarg(fe_Context *ctx, fe_Object **arg);
 int fe_type(fe_Context *ctx, fe_Object *obj);
@@ -44,11 +65,26 @@ fe_Object* fe_number(fe_Context *ctx, fe_Number n);
 fe_Object* fe_string(fe_Context *ctx, const char *str);
 fe_Object* fe_symbol(fe_Context *ctx, const char *name);
 fe_Object* fe_cfunc(fe_Context *ctx, fe_CFunc fn);
+fe_Object* fe_cfuncv(fe_Context *ctx, fe_CFuncV fn);
 fe_Object* fe_ptr(fe_Context *ctx, void *ptr);
 fe_Object* fe_list(fe_Context *ctx, fe_Object **objs, int n);
+fe_Object* fe_vector(fe_Context *ctx, fe_Object **objs, int n);
 fe_Object* fe_car(fe_Context *ctx, fe_Object *obj);
 fe_Object* fe_cdr(fe_Context *ctx, fe_Object *obj);
+int fe_veclen(fe_Context *ctx, fe_Object *obj);
+fe_Object* fe_vecget(fe_Context *ctx, fe_Object *obj, int idx);
+void fe_vecset(fe_Context *ctx, fe_Object *obj, int idx, fe_Object *v);
+fe_Object* fe_table(fe_Context *ctx);
+int fe_tablen(fe_Context *ctx, fe_Object *obj);
+fe_Object* fe_tabget(fe_Context *ctx, fe_Object *obj, fe_Object *key);
+void fe_tabset(fe_Context *ctx, fe_Object *obj, fe_Object *key, fe_Object *v);
+void fe_tabdel(fe_Context *ctx, fe_Object *obj, fe_Object *key);
+int fe_tabnext(fe_Context *ctx, fe_Object *obj, int *iter, fe_Object **key, fe_Object **v);
+fe_Object* fe_array(fe_Context *ctx, const fe_Number *data, int n);
+int fe_arrlen(fe_Context *ctx, fe_Object *obj);
+fe_Number* fe_arrdata(fe_Context *ctx, fe_Object *obj);
 void fe_write(fe_Context *ctx, fe_Object *obj, fe_WriteFn fn, void *udata, int qt);
+void fe_writeblock(fe_Context *ctx, fe_Object *obj, fe_WriteBlockFn fn, void *udata, int qt);
 void fe_writefp(fe_Context *ctx, fe_Object *obj, FILE *fp);
 int fe_tostring(fe_Context *ctx, fe_Object *obj, char *dst, int size);
 fe_Number fe_tonumber(fe_Context *ctx, fe_Object *obj);
@@ -56,6 +92,17 @@ void* fe_toptr(fe_Context *ctx, fe_Object *obj);
 void fe_set(fe_Context *ctx, fe_Object *sym, fe_Object *v);
 fe_Object* fe_read(fe_Context *ctx, fe_ReadFn fn, void *udata);
 fe_Object* fe_readfp(fe_Context *ctx, FILE *fp);
+fe_Object* fe_readbuf(fe_Context *ctx, const char **data, size_t *len);
 fe_Object* fe_eval(fe_Context *ctx, fe_Object *obj);
+fe_Object* fe_expand(fe_Context *ctx, fe_Object *obj);
+fe_Object* fe_compile(fe_Context *ctx, fe_Object *obj);
+fe_Object* fe_run(fe_Context *ctx, fe_Object *fn);
+fe_Object* fe_coroutine(fe_Context *ctx, fe_Object *fn);
+fe_Object* fe_resume(fe_Context *ctx, fe_Object *co, fe_Object *v);
+fe_Object* fe_yield(fe_Context *ctx, fe_Object *v);
+int fe_costatus(fe_Context *ctx, fe_Object *co);
+void fe_profile(fe_Context *ctx, void *ptr, int size);
+void fe_profiletick(fe_Context *ctx);
+void fe_writeprofile(fe_Context *ctx, FILE *fp, int what);
 
 #endif
@@ -0,0 +1,521 @@
+/*
+** Tests of the C API which scripts can't reach. Exits non-zero on the first
+** failed check, naming it; an fe error exits through the default handler.
+**
+** gcc test/api.c src/fe.c -Isrc -o api_test
+*/
+
+#include <setjmp.h>
+#include <string.h>
+#include "fe.h"
+
+#define check(x) \
+  do { if (!(x)) { fprintf(stderr, "%s:%d: check failed: %s\n", \
+    __FILE__, __LINE__, #x); exit(EXIT_FAILURE); } } while (0)
+
+static char data[64000];
+static jmp_buf errjmp;
+static char errmsg[64];
+
+
+static fe_Context* newctx(void) {
+  return fe_open(data, sizeof(data));
+}
+
+
+static double scale(int e) {
+  double x = 1;
+  for (; e > 0; e--) { x *= 10; }
+  for (; e < 0; e++) { x /= 10; }
+  return x;
+}
+
+
+static fe_Object* run(fe_Context *ctx, const char *src) {
+  /* evaluates each form in `src`, returning the last one's result */
+  size_t len = strlen(src);
+  fe_Object *obj, *res = NULL;
+  int gc = fe_savegc(ctx);
+  while ((obj = fe_readbuf(ctx, &src, &len))) {
+    res = fe_eval(ctx, obj);
+    fe_restoregc(ctx, gc);
+    fe_pushgc(ctx, res);
+  }
+  return res;
+}
+
+
+static fe_Object* compile(fe_Context *ctx, const char *src) {
+  /* compiles and runs the one form in `src`, returning its result */
+  size_t len = strlen(src);
+  return fe_run(ctx, fe_compile(ctx, fe_readbuf(ctx, &src, &len)));
+}
+
+
+static fe_Number num(fe_Context *ctx, const char *src) {
+  return fe_tonumber(ctx, run(ctx, src));
+}
+
+
+static void onerror(fe_Context *ctx, const char *msg, fe_Object *cl) {
+  (void) ctx;
+  (void) cl;
+  strcpy(errmsg, msg);
+  longjmp(errjmp, 1);
+}
+
+
+typedef struct { const char *p; } Reader;
+
+static char readchar(fe_Context *ctx, void *udata) {
+  Reader *r = udata;
+  (void) ctx;
+  return *r->p ? *r->p++ : '\0';
+}
+
+
+typedef struct { char buf[4096]; int n, blocks; } Out;
+
+static void writeblock(fe_Context *ctx, void *udata, const char *data, int len) {
+  Out *o = udata;
+  (void) ctx;
+  check(len > 0 && o->n + len < (int) sizeof(o->buf));
+  memcpy(o->buf + o->n, data, len);
+  o->n += len;
+  o->buf[o->n] = '\0';
+  o->blocks++;
+}
+
+
+static void writechar(fe_Context *ctx, void *udata, char chr) {
+  writeblock(ctx, udata, &chr, 1);
+}
+
+
+static void test_numbers(void) {
+  /* numbers are written as sprintf("%.7g") would */
+  static const float edges[] = {
+    0, 1, -1, 0.5f, 0.1f, 1e-4f, 9.9999e-5f, 1e7f, 9999999, 9999999.5f,
+    99999.995f, 123456.7f, 0.000123456f, 3.14159265f, 1e20f, 1e-20f
+  };
+  fe_Context *ctx = newctx();
+  char want[64], got[64];
+  fe_Number x;
+  int i, e, gc = fe_savegc(ctx);
+  for (i = 0; i < (int) (sizeof(edges) / sizeof(*edges)); i++) {
+    sprintf(want, "%.7g", edges[i]);
+    fe_tostring(ctx, fe_number(ctx, edges[i]), got, sizeof(got));
+    check(!strcmp(want, got));
+  }
+  for (e = -8; e <= 4; e++) {
+    for (i = 0; i < 10000; i++) {
+      /* 7 digits taken from across the range, scaled by 10^e; every other
+      ** number is about half way to the next 7 digits, which is where a
+      ** number with more precision than a float rounds differently */
+      x = (fe_Number) ((i * 7919L % 10000000 + (i & 2) / 4.0) * scale(e));
+      if (i & 1) { x = -x; }
+      sprintf(want, "%.7g", (double) x);
+      fe_tostring(ctx, fe_number(ctx, x), got, sizeof(got));
+      check(!strcmp(want, got));
+      fe_restoregc(ctx, gc);
+    }
+  }
+  fe_close(ctx);
+}
+
+
+static void test_writer(void) {
+  /* a string longer than the writer's buffer arrives whole, in several
+  ** blocks, with its quotes escaped; fe_write() sees the same characters */
+  fe_Context *ctx = newctx();
+  char str[1001], want[1200];
+  Out blocks, chars;
+  fe_Object *obj;
+  int i, n = 0;
+  for (i = 0; i < 1000; i++) { str[i] = i % 50 == 0 ? '"' : 'a' + i % 26; }
+  str[1000] = '\0';
+  want[n++] = '"';
+  for (i = 0; i < 1000; i++) {
+    if (str[i] == '"') { want[n++] = '\\'; }
+    want[n++] = str[i];
+  }
+  want[n++] = '"';
+  want[n] = '\0';
+  obj = fe_cons(ctx, fe_string(ctx, str), fe_number(ctx, 2.5f));
+  blocks.n = blocks.blocks = 0;
+  chars.n = chars.blocks = 0;
+  fe_writeblock(ctx, fe_car(ctx, obj), writeblock, &blocks, 1);
+  check(!strcmp(blocks.buf, want));
+  check(blocks.blocks > 1 && blocks.blocks < 10);
+  fe_write(ctx, fe_car(ctx, obj), writechar, &chars, 1);
+  check(!strcmp(chars.buf, want));
+  /* unquoted, and nested in a dotted pair */
+  blocks.n = 0;
+  fe_writeblock(ctx, fe_car(ctx, obj), writeblock, &blocks, 0);
+  check(!strcmp(blocks.buf, str));
+  blocks.n = 0;
+  fe_writeblock(ctx, fe_cons(ctx, fe_number(ctx, 1), obj), writeblock, &blocks, 1);
+  check(blocks.n == n + 10);
+  check(!memcmp(blocks.buf, "(1 ", 3) && !strcmp(blocks.buf + n + 3, " . 2.5)"));
+  fe_close(ctx);
+}
+
+
+static void test_tostring(void) {
+  /* output past the buffer is dropped and the result is terminated */
+  fe_Context *ctx = newctx();
+  fe_Object *objs[3];
+  char buf[8];
+  objs[0] = fe_number(ctx, 1);
+  objs[1] = fe_number(ctx, 22);
+  objs[2] = fe_symbol(ctx, "three");
+  check(fe_tostring(ctx, fe_list(ctx, objs, 3), buf, sizeof(buf)) == 7);
+  check(!strcmp(buf, "(1 22 t"));
+  check(fe_tostring(ctx, objs[1], buf, sizeof(buf)) == 2);
+  check(!strcmp(buf, "22"));
+  fe_close(ctx);
+}
+
+
+static void test_readbuf(void) {
+  /* reads the same as fe_read() does, stopping at the given length rather
+  ** than at a terminator */
+  static const char text[] =
+    "(a (b . c) \"s\\t\\\"q\\\"\") 'x ; comment\n"
+    "12 -3 +5 1.5e-3 1e3 0x10 3. - -- .5 nan?\n"
+    "\"run\" ;; end\n-7";
+  fe_Context *ctx = newctx();
+  char buf[sizeof(text) + 4], want[64], got[64];
+  const char *p = buf;
+  size_t len = sizeof(text) - 1;
+  fe_Object *a, *b;
+  Reader r;
+  int gc = fe_savegc(ctx), n = 0;
+  /* digits past the length must not be read as part of the last number */
+  memcpy(buf, text, len);
+  memcpy(buf + len, "99)", 4);
+  r.p = text;
+  while ((a = fe_readbuf(ctx, &p, &len))) {
+    check(len == (size_t) (sizeof(text) - 1 - (p - buf)));
+    b = fe_read(ctx, readchar, &r);
+    check(b != NULL);
+    fe_tostring(ctx, a, got, sizeof(got));
+    fe_tostring(ctx, b, want, sizeof(want));
+    check(!strcmp(want, got));
+    fe_restoregc(ctx, gc);
+    n++;
+  }
+  check(n == 15 && len == 0 && p == buf + sizeof(text) - 1);
+  check(fe_read(ctx, readchar, &r) == NULL);
+  check(!strcmp(got, "-7"));
+  check(fe_readbuf(ctx, &p, &len) == NULL);
+
+  /* a string or list closed only past the length is unclosed */
+  fe_handlers(ctx)->error = onerror;
+  p = "\"abc\"";
+  len = 4;
+  if (!setjmp(errjmp)) { fe_readbuf(ctx, &p, &len); check(0); }
+  check(!strcmp(errmsg, "unclosed string"));
+  p = "(a b)";
+  len = 4;
+  if (!setjmp(errjmp)) { fe_readbuf(ctx, &p, &len); check(0); }
+  check(!strcmp(errmsg, "unclosed list"));
+  fe_close(ctx);
+}
+
+
+static void test_expand(void) {
+  /* macro calls are replaced up front, except in quoted data and for
+  ** macros not yet defined; evaluating the result changes only those */
+  fe_Context *ctx = newctx();
+  fe_Object *obj;
+  char before[128], after[128];
+  size_t len;
+  int n;
+  const char *p;
+  run(ctx, "(= inc (mac (x) (list '= x (list '+ x 1))))");
+  p = "(do (= add1 (fn (n) (inc n) n)) (= g 1) (inc g)"
+      "    (while (< g 5) (inc g)) '(inc q) (later g))";
+  len = strlen(p);
+  obj = fe_expand(ctx, fe_readbuf(ctx, &p, &len));
+  fe_tostring(ctx, obj, before, sizeof(before));
+  check(!strcmp(before, "(do (= add1 (fn (n) (= n (+ n 1)) n)) (= g 1) "
+    "(= g (+ g 1)) (while (< g 5) (= g (+ g 1))) (quote (inc q)) (later g))"));
+  run(ctx, "(= later (mac (x) x))");
+  check(fe_tonumber(ctx, fe_eval(ctx, obj)) == 5);
+  check(num(ctx, "(add1 41)") == 42);
+  check(fe_tonumber(ctx, fe_eval(ctx, obj)) == 5);
+  fe_tostring(ctx, obj, after, sizeof(after));
+  /* only the call to the macro defined afterwards was replaced */
+  n = strstr(before, "(later") - before;
+  check(!strncmp(before, after, n) && strcmp(before + n, after + n));
+  fe_close(ctx);
+}
+
+
+static fe_Object* twice(fe_Context *ctx, fe_Object *arg) {
+  return fe_number(ctx, fe_tonumber(ctx, fe_nextarg(ctx, &arg)) * 2);
+}
+
+
+static fe_Object* thrice(fe_Context *ctx, fe_Object *arg) {
+  return fe_number(ctx, fe_tonumber(ctx, fe_nextarg(ctx, &arg)) * 3);
+}
+
+
+typedef struct { char *buf, *mem; int n; } Image;
+
+static void writeimage(fe_Context *ctx, void *udata, const char *data, int len) {
+  Image *img = udata;
+  (void) ctx;
+  img->buf = realloc(img->buf, img->n + len);
+  memcpy(img->buf + img->n, data, len);
+  img->n += len;
+}
+
+
+static fe_Context* openimage(Image *img, int size, const fe_Binding *b) {
+  /* opens a copy of the first `size` bytes of the image, in memory of
+  ** exactly that size, such that a read past it is caught by a sanitizer */
+  fe_Context *ctx;
+  img->mem = malloc(size);
+  memcpy(img->mem, img->buf, size);
+  ctx = fe_openimage(img->mem, size, b);
+  if (!ctx) { free(img->mem); }
+  return ctx;
+}
+
+
+static void test_image(void) {
+  /* a saved context carries on where it left off, at a new address, with
+  ** cfuncs and ptrs bound again by name */
+  static int saved, loaded;
+  fe_Binding save[] = {
+    { "twice", twice, NULL, NULL }, { "counter", NULL, &saved, NULL },
+    { NULL, NULL, NULL, NULL }
+  };
+  fe_Binding load[] = {
+    { "counter", NULL, &loaded, NULL }, { "twice", thrice, NULL, NULL },
+    { NULL, NULL, NULL, NULL }
+  };
+  fe_Context *ctx = newctx();
+  Image img;
+  char buf[16];
+  int recs;
+  fe_set(ctx, fe_symbol(ctx, "twice"), fe_cfunc(ctx, twice));
+  fe_set(ctx, fe_symbol(ctx, "counter"), fe_ptr(ctx, &saved));
+  run(ctx, "(= v (vector 1 2 3)) (= t (table 'a 1)) (= s \"hello\")"
+           "(= add (fn (a b) (+ a b))) (= n (twice 21))");
+  fe_run(ctx, fe_compile(ctx, run(ctx, "'(= sq (fn (x) (* x x)))")));
+  img.buf = NULL;
+  img.n = 0;
+  fe_saveimage(ctx, save, writeimage, &img);
+  fe_close(ctx);
+  memset(data, 0, sizeof(data));
+
+  ctx = openimage(&img, img.n, load);
+  check(ctx != NULL);
+  check(num(ctx, "n") == 42);
+  check(num(ctx, "(twice 21)") == 63);
+  check(fe_toptr(ctx, run(ctx, "counter")) == &loaded);
+  check(num(ctx, "(vecget v 1)") == 2);
+  check(num(ctx, "(tabget t 'a)") == 1);
+  fe_tostring(ctx, run(ctx, "s"), buf, sizeof(buf));
+  check(!strcmp(buf, "hello"));
+  check(num(ctx, "(add 2 3)") == 5);
+  check(num(ctx, "(sq 7)") == 49);
+  /* the heap still collects and allocates */
+  run(ctx, "(= l nil) (do (let i 0) (while (< i 2000) (= l (cons i l))"
+           "(= i (+ i 1))))");
+  check(num(ctx, "(car l)") == 1999);
+  fe_close(ctx);
+  free(img.mem);
+
+  /* a damaged image is refused: the binding records cut short, the last
+  ** name not terminated, or a bad header */
+  recs = 2 * (sizeof(fe_CFunc) + sizeof(void*) + sizeof(fe_CFuncV)) +
+    sizeof("twice") + sizeof("counter");
+  check(!openimage(&img, img.n - 1, load));
+  check(!openimage(&img, img.n - sizeof("counter") - 2, load));
+  check(!openimage(&img, img.n - recs, load));
+  check(!openimage(&img, 40, load));
+  img.buf[img.n - 1] = 'x';
+  check(!openimage(&img, img.n, load));
+  img.buf[img.n - 1] = '\0';
+  img.buf[0] = 'x';
+  check(!openimage(&img, img.n, load));
+  free(img.buf);
+}
+
+
+static void test_vectors(void) {
+  fe_Context *ctx = newctx();
+  fe_Object *objs[3], *vec;
+  int i;
+  for (i = 0; i < 3; i++) { objs[i] = fe_number(ctx, i * 10); }
+  vec = fe_vector(ctx, objs, 3);
+  check(fe_type(ctx, vec) == FE_TVECTOR && fe_veclen(ctx, vec) == 3);
+  check(fe_tonumber(ctx, fe_vecget(ctx, vec, 2)) == 20);
+  fe_vecset(ctx, vec, 0, fe_bool(ctx, 0));
+  check(fe_isnil(ctx, fe_vecget(ctx, vec, 0)));
+  check(fe_veclen(ctx, fe_vector(ctx, NULL, 0)) == 0);
+
+  /* indexes past either end raise an error from C and from a script */
+  fe_handlers(ctx)->error = onerror;
+  if (!setjmp(errjmp)) { fe_vecget(ctx, vec, 3); check(0); }
+  check(!strcmp(errmsg, "vector index out of range"));
+  if (!setjmp(errjmp)) { fe_vecset(ctx, vec, -1, vec); check(0); }
+  check(!strcmp(errmsg, "vector index out of range"));
+  if (!setjmp(errjmp)) { run(ctx, "(vecget (vector 1) 1)"); check(0); }
+  check(!strcmp(errmsg, "vector index out of range"));
+  fe_close(ctx);
+}
+
+
+static void test_tables(void) {
+  fe_Context *ctx = newctx();
+  fe_Object *tab = fe_table(ctx), *key, *val;
+  int i, n, iter, gc = fe_savegc(ctx);
+  char seen[200], in[200];
+
+  /* a missing key gives NULL, a key paired with nil gives nil */
+  check(fe_tabget(ctx, tab, fe_symbol(ctx, "a")) == NULL);
+  fe_tabset(ctx, tab, fe_symbol(ctx, "a"), fe_bool(ctx, 0));
+  check(fe_isnil(ctx, fe_tabget(ctx, tab, fe_symbol(ctx, "a"))));
+  fe_tabdel(ctx, tab, fe_symbol(ctx, "a"));
+  check(fe_tabget(ctx, tab, fe_symbol(ctx, "a")) == NULL);
+  check(fe_tablen(ctx, tab) == 0);
+
+  /* keys set and removed in a scrambled order, so that runs wrap around the
+  ** end of the entries and removals move later entries back; every key
+  ** must stay reachable, and fe_tabnext() must visit each once */
+  memset(in, 0, sizeof(in));
+  for (n = 0; n < 4000; n++) {
+    i = n * 37 % 200;
+    key = fe_number(ctx, i);
+    if (n % 3 == 2) {
+      fe_tabdel(ctx, tab, key);
+      in[i] = 0;
+    } else {
+      fe_tabset(ctx, tab, key, fe_number(ctx, -i));
+      in[i] = 1;
+    }
+    fe_restoregc(ctx, gc);
+    if (n % 100 != 99) { continue; }
+    for (i = 0; i < 200; i++) {
+      val = fe_tabget(ctx, tab, fe_number(ctx, i));
+      check(in[i] ? val && fe_tonumber(ctx, val) == -i : val == NULL);
+      fe_restoregc(ctx, gc);
+    }
+    memset(seen, 0, sizeof(seen));
+    for (i = iter = 0; fe_tabnext(ctx, tab, &iter, &key, &val); i++) {
+      check(in[(int) fe_tonumber(ctx, key)]);
+      check(!seen[(int) fe_tonumber(ctx, key)]++);
+    }
+    check(i == fe_tablen(ctx, tab));
+  }
+  fe_close(ctx);
+}
+
+
+static void test_arrays(void) {
+  static const fe_Number data[] = { 1, 2, 3, 4, 5 };
+  static const char *bad[][2] = {
+    { "(arrget (makearr 2) 2)",             "array index out of range" },
+    { "(arrset (makearr 2) -1 0)",          "array index out of range" },
+    { "(makearr -1)",                       "bad array length" },
+    { "(arradd (makearr 2) (makearr 3) 1)", "array lengths differ" },
+    { "(arrdot (makearr 2) (makearr 3))",   "array lengths differ" },
+    { "(arrmin (makearr 0))",               "empty array" }
+  };
+  fe_Context *ctx = newctx();
+  fe_Object *arr;
+  fe_Number *p;
+  int i;
+
+  /* the array holds a copy, and writes through fe_arrdata() are seen by
+  ** scripts */
+  arr = fe_array(ctx, data, 5);
+  check(fe_type(ctx, arr) == FE_TARRAY && fe_arrlen(ctx, arr) == 5);
+  p = fe_arrdata(ctx, arr);
+  check(p != data && p[4] == 5);
+  p[0] = 10;
+  fe_set(ctx, fe_symbol(ctx, "a"), arr);
+  check(num(ctx, "(arrsum a)") == 24);
+  check(fe_arrlen(ctx, fe_array(ctx, NULL, 0)) == 0);
+
+  fe_handlers(ctx)->error = onerror;
+  for (i = 0; i < (int) (sizeof(bad) / sizeof(*bad)); i++) {
+    if (!setjmp(errjmp)) { run(ctx, bad[i][0]); check(0); }
+    check(!strcmp(errmsg, bad[i][1]));
+  }
+  fe_close(ctx);
+}
+
+
+static fe_Object* wait(fe_Context *ctx, fe_Object *arg) {
+  return fe_yield(ctx, fe_nextarg(ctx, &arg));
+}
+
+
+static void test_coroutines(void) {
+  static const char *bad[][2] = {
+    { "(fn (x) (wait x))",      "cannot yield across a C call" },
+    { "(fn (x) (yield x))",     "cannot yield from evaluated code" },
+    { "(fn (x) (resume self))", "cannot resume running coroutine" },
+    { "(fn (x) (car x))",       "expected pair, got number" }
+  };
+  fe_Context *ctx = newctx();
+  fe_Object *co, *self = fe_symbol(ctx, "self");
+  int i;
+
+  /* a cfunc yields the value it was called with, and the next resume's
+  ** value becomes the result of the call */
+  fe_set(ctx, fe_symbol(ctx, "wait"), fe_cfunc(ctx, wait));
+  co = fe_coroutine(ctx, compile(ctx,
+    "(fn (x) (let a (wait x)) (let b (wait (+ a 1))) (* a b))"));
+  check(fe_costatus(ctx, co) == FE_CSUSPENDED);
+  check(fe_tonumber(ctx, fe_resume(ctx, co, fe_number(ctx, 3))) == 3);
+  check(fe_tonumber(ctx, fe_resume(ctx, co, fe_number(ctx, 10))) == 11);
+  check(fe_costatus(ctx, co) == FE_CSUSPENDED);
+  check(fe_tonumber(ctx, fe_resume(ctx, co, fe_number(ctx, 5))) == 50);
+  check(fe_costatus(ctx, co) == FE_CDEAD);
+
+  fe_handlers(ctx)->error = onerror;
+  if (!setjmp(errjmp)) { fe_resume(ctx, co, NULL); check(0); }
+  check(!strcmp(errmsg, "cannot resume dead coroutine"));
+  if (!setjmp(errjmp)) { run(ctx, "(wait 1)"); check(0); }
+  check(!strcmp(errmsg, "yield outside of a coroutine"));
+
+  /* an error inside a coroutine leaves it dead, and no longer running, so
+  ** the next coroutine can yield as usual */
+  for (i = 0; i < (int) (sizeof(bad) / sizeof(*bad)); i++) {
+    /* the first two fns are evaluated rather than compiled */
+    fe_Object *fn = i < 2 ? run(ctx, bad[i][0]) : compile(ctx, bad[i][0]);
+    co = fe_coroutine(ctx, fn);
+    fe_set(ctx, self, co);
+    if (!setjmp(errjmp)) { fe_resume(ctx, co, fe_number(ctx, 1)); check(0); }
+    check(!strcmp(errmsg, bad[i][1]));
+    check(fe_costatus(ctx, co) == FE_CDEAD);
+  }
+  co = fe_coroutine(ctx, compile(ctx, "(fn (x) (wait x) (yield 2) 3)"));
+  check(fe_tonumber(ctx, fe_resume(ctx, co, fe_number(ctx, 1))) == 1);
+  check(fe_tonumber(ctx, fe_resume(ctx, co, NULL)) == 2);
+  check(fe_tonumber(ctx, fe_resume(ctx, co, NULL)) == 3);
+  fe_close(ctx);
+}
+
+
+int main(void) {
+  test_readbuf();
+  test_numbers();
+  test_writer();
+  test_tostring();
+  test_image();
+  test_expand();
+  test_vectors();
+  test_tables();
+  test_arrays();
+  test_coroutines();
+  return EXIT_SUCCESS;
+}
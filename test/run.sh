@@ -0,0 +1,59 @@
+#!/bin/bash
+# Runs each test script with the standalone build, evaluated and compiled,
+# after test/prelude.fe. A script fails by raising an error, or by printing
+# something different when compiled; the demo scripts must also print the
+# same either way. A script starting with "; eval only" is not compiled, and
+# one starting with "; compiled only" is not evaluated. test/api.c, which
+# tests the C API, is built and run too. Run from the repo root after build.sh
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+run() {
+  if head -n 1 "$1" | grep -q '^; compiled only'; then
+    if ! ./fe -c "$2" > /dev/null; then
+      echo "FAIL $1 -c"
+      fail=1
+    fi
+  elif ! ./fe "$2" > "$tmp/eval.out"; then
+    echo "FAIL $1"
+    fail=1
+  elif head -n 1 "$1" | grep -q '^; eval only'; then
+    return
+  elif ! ./fe -c "$2" > "$tmp/compiled.out"; then
+    echo "FAIL $1 -c"
+    fail=1
+  elif ! cmp -s "$tmp/eval.out" "$tmp/compiled.out"; then
+    echo "FAIL $1 -c: output differs"
+    fail=1
+  fi
+}
+
+# assigns ever longer string literals, up to 8000 characters, to the same
+# variable in the 64KB heap of the standalone build; each string's dropped
+# block must be joined with its neighbours for the next, longer one to fit.
+# Generated here as the file would be large
+mkdir "$tmp/gen"
+s=
+for i in $(seq 40); do
+  s=$s$(printf '%200s' | tr ' ' x)
+  echo "(= s \"$s\")"
+done > "$tmp/gen/strings.fe"
+echo "(check (is s \"$s\"))" >> "$tmp/gen/strings.fe"
+
+for f in test/*.fe "$tmp"/gen/*.fe; do
+  [ "$f" = test/prelude.fe ] && continue
+  cat test/prelude.fe "$f" > "$tmp/test.fe"
+  run "$f" "$tmp/test.fe"
+done
+for f in scripts/*.fe; do
+  run "$f" "$f"
+done
+
+if ! gcc test/api.c src/fe.c -Isrc -o "$tmp/api" || ! "$tmp/api"; then
+  echo "FAIL test/api.c"
+  fail=1
+fi
+
+[ $fail = 0 ] && echo "all tests passed"
+exit $fail